@@ -0,0 +1,149 @@
+#! /usr/bin/env python3
+# -*- coding: utf-8; -*-
+
+"""
+    Benchmark de lectura de órdenes de simplesh (líneas/s)
+
+    Genera un fichero de órdenes y mide cuántas líneas por segundo procesa
+    simplesh según de dónde las lea:
+      - fichero   `simplesh ordenes.txt`
+      - -c        `simplesh -c "$(cat ordenes.txt)"` (sólo las primeras líneas
+                  que caben en un argumento)
+      - stdin     `simplesh < ordenes.txt`
+      - tubería   `cat ordenes.txt | simplesh`
+      - terminal  las mismas líneas tecleadas en un pseudoterminal (readline)
+    Las órdenes son comandos internos (sin fork) para que domine el coste de
+    leer y analizar cada línea. Cada resultado se añade como una línea JSON al
+    fichero de salida.
+
+    Ejemplo: python3 bench/bench_lineas.py --shell ./simplesh --out bench/lineas.jsonl
+"""
+
+import argparse
+import json
+import os
+import pty
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+# Un único argumento de execve() no puede superar MAX_ARG_STRLEN (32 páginas)
+MAX_ARG_C = 128 * 1024 - 1
+
+ORDENES = [
+    'cd .',
+    'cwd > /dev/null',
+    'cd . ; cd .',
+    'hash -r',
+]
+
+
+def info(*args):
+    print("{}:".format(os.path.basename(sys.argv[0])), *args, file=sys.stderr)
+
+
+def parse_arguments():
+    parser = argparse.ArgumentParser(description='Benchmark de lectura de órdenes de simplesh')
+    parser.add_argument('--shell', default='./simplesh', help='Binario de simplesh.')
+    parser.add_argument('--out', default='bench/lineas.jsonl', help='Fichero de resultados (JSON por línea).')
+    parser.add_argument('--lines', type=int, default=100000, help='Número de líneas del fichero de órdenes.')
+    parser.add_argument('--modes', default='fichero,-c,stdin,tuberia,terminal', help='Modos a medir, separados por comas.')
+    parser.add_argument('--reps', type=int, default=3, help='Repeticiones de cada modo (se guarda la mejor).')
+    return parser.parse_args()
+
+
+def terminal(shell, ordenes, cwd):
+    """ Teclea 'ordenes' en simplesh a través de un pseudoterminal. """
+    maestro, esclavo = pty.openpty()
+    proc = subprocess.Popen([shell], cwd=cwd, stdin=esclavo, stdout=esclavo, stderr=esclavo,
+                            start_new_session=True)
+    os.close(esclavo)
+
+    def vaciar():
+        try:
+            while os.read(maestro, 65536):
+                pass
+        except OSError:
+            pass
+
+    lector = threading.Thread(target=vaciar)
+    lector.start()
+    with open(ordenes, 'rb') as f:
+        for linea in f:
+            os.write(maestro, linea)
+    os.write(maestro, b'exit\n')
+    proc.wait()
+    lector.join()
+    os.close(maestro)
+
+
+def ejecutar(shell, modo, ordenes, cwd):
+    """ Ejecuta simplesh con las órdenes de 'ordenes' en el modo indicado.
+        Devuelve los segundos y las líneas ejecutadas. """
+    with open(ordenes) as f:
+        texto = f.read()
+    lineas = texto.count('\n')
+    if modo == '-c' and len(texto) > MAX_ARG_C:
+        texto = texto[:texto.rindex('\n', 0, MAX_ARG_C) + 1]
+        lineas = texto.count('\n')
+    inicio = time.monotonic()
+    if modo == 'fichero':
+        subprocess.run([shell, ordenes], cwd=cwd, stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, check=True)
+    elif modo == '-c':
+        subprocess.run([shell, '-c', texto], cwd=cwd, stdin=subprocess.DEVNULL,
+                       stdout=subprocess.DEVNULL, check=True)
+    elif modo == 'stdin':
+        with open(ordenes) as f:
+            subprocess.run([shell], cwd=cwd, stdin=f, stdout=subprocess.DEVNULL, check=True)
+    elif modo == 'tuberia':
+        cat = subprocess.Popen(['cat', ordenes], stdout=subprocess.PIPE)
+        subprocess.run([shell], cwd=cwd, stdin=cat.stdout, stdout=subprocess.DEVNULL, check=True)
+        cat.stdout.close()
+        cat.wait()
+    elif modo == 'terminal':
+        terminal(shell, ordenes, cwd)
+    else:
+        raise ValueError('modo desconocido: {}'.format(modo))
+    return time.monotonic() - inicio, lineas
+
+
+def main():
+    args = parse_arguments()
+    shell = os.path.abspath(args.shell)
+    if not os.access(shell, os.X_OK):
+        info('No existe el binario {}'.format(shell))
+        return 1
+
+    version = subprocess.run(['git', 'describe', '--always', '--dirty'], capture_output=True,
+                             text=True, cwd=os.path.dirname(shell)).stdout.strip() or None
+
+    with tempfile.TemporaryDirectory() as tmp, open(args.out, 'a') as out:
+        ordenes = os.path.join(tmp, 'ordenes.txt')
+        with open(ordenes, 'w') as f:
+            for i in range(args.lines):
+                f.write(ORDENES[i % len(ORDENES)] + '\n')
+
+        for modo in args.modes.split(','):
+            segundos, lineas = min(ejecutar(shell, modo, ordenes, tmp) for _ in range(args.reps))
+            resultado = {
+                'version': version,
+                'fecha': time.strftime('%Y-%m-%dT%H:%M:%S'),
+                'modo': modo,
+                'lineas': lineas,
+                'segundos': round(segundos, 6),
+                'lineas_s': round(lineas / segundos, 1),
+            }
+            out.write(json.dumps(resultado) + '\n')
+            out.flush()
+            print('{:10} {:>8} líneas {:>10.3f} s {:>12.1f} líneas/s'.format(
+                modo, lineas, segundos, resultado['lineas_s']))
+
+    info('Resultados añadidos a {}'.format(args.out))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
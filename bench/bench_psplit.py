@@ -0,0 +1,199 @@
+#! /usr/bin/env python3
+# -*- coding: utf-8; -*-
+
+"""
+    Benchmark de rendimiento de `psplit` en simplesh
+
+    Genera entradas sintéticas de varios tamaños y longitudes de línea, ejecuta
+    `psplit` con distintas combinaciones de -l/-b/-s/-p (leyendo de fichero y
+    de una tubería) y mide para cada ejecución:
+      - MB/s (tiempo real de la orden completa)
+      - llamadas al sistema (con `strace -f -c`, si está instalado)
+      - memoria máxima residente (ru_maxrss de wait4, medida con bench/medir)
+    Cada resultado se añade como una línea JSON al fichero de salida para poder
+    comparar versiones de do_psplit()/run_psplit().
+
+    Ejemplo: python3 bench/bench_psplit.py --shell ./simplesh --out bench/resultados.jsonl
+"""
+
+import argparse
+import itertools
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+
+MB = 1 << 20
+
+
+def info(*args):
+    print("{}:".format(os.path.basename(sys.argv[0])), *args, file=sys.stderr)
+
+
+def parse_arguments():
+    parser = argparse.ArgumentParser(description='Benchmark de psplit')
+    parser.add_argument('--shell', default='./simplesh', help='Binario de simplesh.')
+    parser.add_argument('--medir', default='bench/medir', help='Programa que mide tiempo y memoria (bench/medir.c).')
+    parser.add_argument('--out', default='bench/resultados.jsonl', help='Fichero de resultados (JSON por línea).')
+    parser.add_argument('--sizes', default='8,64', help='Tamaños de las entradas en MiB, separados por comas.')
+    parser.add_argument('--lines', default='16,100,1000', help='Longitudes de línea de las entradas de texto.')
+    parser.add_argument('--procs', default='1,{}'.format(os.cpu_count() or 1), help='Valores de -p.')
+    parser.add_argument('--extra', default='', help='Opciones adicionales para psplit (p.ej. "--io=uring --sync=end").')
+    parser.add_argument('--reps', type=int, default=3, help='Repeticiones de cada caso (se guarda la mejor).')
+    parser.add_argument('--quick', action='store_true', help='Sólo un tamaño y una longitud de línea.')
+    return parser.parse_args()
+
+
+def generar_entradas(tmp, sizes, lines):
+    """ Ficheros de texto con líneas de longitud fija y uno binario aleatorio por tamaño. """
+    entradas = []
+    rnd = random.Random(0)
+    for size in sizes:
+        for linea in lines:
+            nombre = os.path.join(tmp, 'texto_{}M_{}'.format(size, linea))
+            bloque = b''.join(bytes([97 + rnd.randrange(26)]) * (linea - 1) + b'\n' for _ in range(max(1, MB // linea)))
+            with open(nombre, 'wb') as f:
+                escrito = 0
+                while escrito < size * MB:
+                    f.write(bloque[:size * MB - escrito])
+                    escrito += min(len(bloque), size * MB - escrito)
+            entradas.append({'fichero': nombre, 'tipo': 'texto', 'mib': size, 'linea': linea})
+        nombre = os.path.join(tmp, 'binario_{}M'.format(size))
+        with open(nombre, 'wb') as f:
+            f.write(rnd.randbytes(size * MB) if hasattr(rnd, 'randbytes') else os.urandom(size * MB))
+        entradas.append({'fichero': nombre, 'tipo': 'binario', 'mib': size, 'linea': None})
+    return entradas
+
+
+def casos(entrada, procs):
+    """ Combinaciones de opciones de psplit para una entrada. """
+    if entrada['tipo'] == 'texto':
+        modos = ['-l 1000', '-l 100000']
+    else:
+        modos = ['-b 65536', '-b 1048576']
+    bloques = ['', '-s 4096', '-s 1048576']
+    for modo, bloque, p, tuberia in itertools.product(modos, bloques, procs, [False, True]):
+        # Con la entrada por una tubería -p no tiene efecto
+        if tuberia and p != 1:
+            continue
+        yield modo, bloque, p, tuberia
+
+
+def ejecutar(shell, medir, orden, cwd, strace):
+    """ Ejecuta 'orden' en simplesh. Devuelve (segundos, ru_maxrss en KiB, llamadas al sistema). """
+    argv = [shell]
+    traza = None
+    if strace:
+        traza = os.path.join(cwd, '.strace')
+        argv = [strace, '-f', '-c', '-o', traza] + argv
+    medida = os.path.join(cwd, '.medida')
+    proc = subprocess.run([medir, medida] + argv, cwd=cwd, input=(orden + '\n').encode(),
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    errores = proc.stderr
+    with open(medida) as f:
+        segundos, maxrss = f.read().split()
+    os.unlink(medida)
+    errores = errores.decode(errors='replace')
+    if errores.strip():
+        info('stderr de "{}": {}'.format(orden, errores.strip()))
+
+    llamadas = None
+    if traza and os.path.exists(traza):
+        with open(traza) as f:
+            for linea in f:
+                campos = linea.split()
+                if campos and campos[-1] == 'total':
+                    # % time, seconds, usecs/call, calls, [errors,] total
+                    llamadas = int(campos[3]) if len(campos) >= 5 else None
+        os.unlink(traza)
+    return float(segundos), int(maxrss), llamadas
+
+
+def main():
+    args = parse_arguments()
+    shell = os.path.abspath(args.shell)
+    medir = os.path.abspath(args.medir)
+    for binario in (shell, medir):
+        if not os.access(binario, os.X_OK):
+            info('No existe el binario {}'.format(binario))
+            return 1
+
+    sizes = [int(x) for x in args.sizes.split(',')]
+    lines = [int(x) for x in args.lines.split(',')]
+    procs = sorted({int(x) for x in args.procs.split(',')})
+    if args.quick:
+        sizes, lines = sizes[:1], lines[:1]
+    strace = shutil.which('strace')
+    if not strace:
+        info('strace no está instalado: no se contarán las llamadas al sistema')
+
+    version = subprocess.run(['git', 'describe', '--always', '--dirty'], capture_output=True,
+                             text=True, cwd=os.path.dirname(shell)).stdout.strip() or None
+
+    with tempfile.TemporaryDirectory() as tmp, open(args.out, 'a') as out:
+        info('Generando entradas en {}'.format(tmp))
+        entradas = generar_entradas(tmp, sizes, lines)
+
+        for entrada in entradas:
+            tam = os.path.getsize(entrada['fichero'])
+            for modo, bloque, p, tuberia in casos(entrada, procs):
+                opciones = ' '.join(x for x in [modo, bloque, '-p {}'.format(p), args.extra] if x)
+                mejor = None
+                for _ in range(args.reps):
+                    run = tempfile.mkdtemp(dir=tmp)
+                    os.link(entrada['fichero'], os.path.join(run, 'entrada'))
+                    if tuberia:
+                        orden = 'cat entrada | psplit {}'.format(opciones)
+                        prefijo = 'stdin'
+                    else:
+                        orden = 'psplit {} entrada'.format(opciones)
+                        prefijo = 'entrada'
+
+                    # La primera repetición mide también las llamadas al sistema
+                    medida = ejecutar(shell, medir, orden, run, None)
+                    llamadas = ejecutar(shell, medir, orden, run, strace)[2] if strace and mejor is None else None
+
+                    salidas = [f for f in os.listdir(run) if f.startswith(prefijo) and f != 'entrada']
+                    total = sum(os.path.getsize(os.path.join(run, f)) for f in salidas)
+                    if total != tam:
+                        info('"{}": los trozos suman {} bytes en vez de {}'.format(orden, total, tam))
+                    shutil.rmtree(run)
+
+                    if mejor is None or medida[0] < mejor['segundos']:
+                        mejor = {'segundos': medida[0], 'max_rss_kib': medida[1],
+                                 'llamadas': llamadas if llamadas is not None else (mejor or {}).get('llamadas'),
+                                 'ficheros': len(salidas)}
+                    elif llamadas is not None:
+                        mejor['llamadas'] = llamadas
+
+                resultado = {
+                    'version': version,
+                    'fecha': time.strftime('%Y-%m-%dT%H:%M:%S'),
+                    'entrada': entrada['tipo'],
+                    'mib': entrada['mib'],
+                    'linea': entrada['linea'],
+                    'tuberia': tuberia,
+                    'opciones': opciones,
+                    'segundos': round(mejor['segundos'], 6),
+                    'mb_s': round(tam / MB / mejor['segundos'], 2),
+                    'llamadas': mejor['llamadas'],
+                    'max_rss_kib': mejor['max_rss_kib'],
+                    'ficheros': mejor['ficheros'],
+                }
+                out.write(json.dumps(resultado) + '\n')
+                out.flush()
+                print('{:8} {:>4}MiB {:>5} {:6} {:40} {:>9.1f} MB/s {:>9} llamadas {:>7} KiB'.format(
+                    entrada['tipo'], entrada['mib'], entrada['linea'] or '-', 'tubo' if tuberia else 'fich',
+                    opciones, resultado['mb_s'], resultado['llamadas'] or '-', resultado['max_rss_kib']))
+
+    info('Resultados añadidos a {}'.format(args.out))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
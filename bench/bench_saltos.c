@@ -0,0 +1,103 @@
+/*
+ * Microbenchmark de la búsqueda de saltos de línea de psplit -l
+ *
+ * Compara el bucle byte a byte original de do_psplit() con las versiones de
+ * buscar_saltos() (escalar, SSE2, AVX2 y la elegida en tiempo de ejecución)
+ * sobre entradas sintéticas con distintas longitudes de línea.
+ *
+ * Uso: make bench-saltos && ./bench/bench_saltos [MBYTES]
+ */
+
+#define main simplesh_main
+#include "../simplesh.c"
+#undef main
+
+#include <time.h>
+
+// Bucle de do_psplit() anterior a buscar_saltos(), como referencia
+size_t buscar_saltos_original(const char * buffer, size_t n, int l, int * saltos){
+    size_t i = 0;
+
+    do {
+        if (buffer[i] == '\n')
+            (*saltos)++;
+        i++;
+    } while ((i < n) && (*saltos < l));
+    return i;
+}
+
+double ahora(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Recorre todo el buffer troceándolo cada 'l' líneas, como hace psplit
+double medir(size_t (*f)(const char *, size_t, int, int *),
+             const char * buffer, size_t n, int l, long * trozos){
+    double t = ahora();
+    size_t i = 0;
+    int saltos = 0;
+
+    *trozos = 0;
+    while (i < n) {
+        if (saltos >= l) {     // con l == 0 un salto deja saltos == 1
+            saltos = 0;
+            (*trozos)++;
+        }
+        i += f(buffer + i, n - i, l, &saltos);
+    }
+    return ahora() - t;
+}
+
+int main(int argc, char ** argv){
+    size_t n = (argc > 1 ? atol(argv[1]) : 256) << 20;
+    const int longitudes[] = { 8, 80, 1024 };
+    // l == 0 comprueba que todas las versiones avanzan aunque no haya que
+    // contar ningún salto (un trozo por byte, como el bucle original)
+    const int ls[] = { 0, 1, 1000, INT_MAX };
+    struct {
+        const char * nombre;
+        size_t (*f)(const char *, size_t, int, int *);
+    } versiones[] = {
+        { "original", buscar_saltos_original },
+        { "escalar",  buscar_saltos_escalar },
+#if defined(__x86_64__) || defined(__i386__)
+        { "sse2",     buscar_saltos_sse2 },
+        { "avx2",     buscar_saltos_avx2 },
+#endif
+        { "dispatch", buscar_saltos },
+    };
+    char * buffer;
+
+    if ((buffer = malloc(n)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-10s %8s %10s %10s %10s\n", "version", "linea", "l", "trozos", "MB/s");
+    for (int a = 0; a < sizeof(longitudes) / sizeof(*longitudes); a++) {
+        for (size_t i = 0; i < n; i++)
+            buffer[i] = (i % longitudes[a] == longitudes[a] - 1) ? '\n' : 'a' + i % 26;
+
+        for (int b = 0; b < sizeof(ls) / sizeof(*ls); b++) {
+            long referencia = -1, trozos;
+            for (int v = 0; v < sizeof(versiones) / sizeof(*versiones); v++) {
+#if defined(__x86_64__) || defined(__i386__)
+                if (versiones[v].f == buscar_saltos_avx2 && !__builtin_cpu_supports("avx2"))
+                    continue;
+#endif
+                double t = medir(versiones[v].f, buffer, n, ls[b], &trozos);
+                if (referencia == -1)
+                    referencia = trozos;
+                else if (trozos != referencia)
+                    panic("%s: %ld trozos en vez de %ld\n", versiones[v].nombre, trozos, referencia);
+                printf("%-10s %8d %10d %10ld %10.0f\n",
+                       versiones[v].nombre, longitudes[a], ls[b], trozos, n / t / (1 << 20));
+            }
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Ejecuta una orden y escribe en FICHERO su tiempo real (segundos) y su
+ * memoria máxima residente (KiB, ru_maxrss de wait4).
+ *
+ * bench_psplit.py lanza simplesh a través de este programa porque ru_maxrss
+ * conserva el máximo anterior a execve(): un hijo creado directamente desde
+ * Python heredaría como máximo la memoria del propio intérprete.
+ *
+ * Uso: bench/medir FICHERO ORDEN [ARGUMENTOS...]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char ** argv)
+{
+    struct timespec ini, fin;
+    struct rusage uso;
+    int estado;
+    pid_t pid;
+    FILE * salida;
+
+    if (argc < 3) {
+        fprintf(stderr, "Uso: %s FICHERO ORDEN [ARGUMENTOS...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ini);
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        execvp(argv[2], argv + 2);
+        perror("execvp");
+        exit(EXIT_FAILURE);
+    }
+    if (wait4(pid, &estado, 0, &uso) == -1) {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+
+    if ((salida = fopen(argv[1], "w")) == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(salida, "%.6f %ld\n",
+            (fin.tv_sec - ini.tv_sec) + (fin.tv_nsec - ini.tv_nsec) / 1e9, uso.ru_maxrss);
+    fclose(salida);
+
+    return WIFEXITED(estado) ? WEXITSTATUS(estado) : EXIT_FAILURE;
+}
@@ -17,7 +17,7 @@
  */
 
 
-#define _POSIX_C_SOURCE 200809L /* IEEE 1003.1-2008 (véase /usr/include/features.h) */
+#define _GNU_SOURCE             /* IEEE 1003.1-2008 + extensiones de Linux (véase /usr/include/features.h) */
 //#define NDEBUG                /* Traduce asertos y DMACROS a 'no ops' */
 
 #include <math.h>
@@ -30,15 +30,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 // Bibliotecas que hemos necesitado añadir para realizar las practicas
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
 #include <pwd.h>
 #include <limits.h>
 #include <libgen.h>
 #include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <spawn.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Biblioteca readline
 #include <readline/readline.h>
@@ -89,20 +105,34 @@ static int g_dbg_level = 0;
     } while( 0 )
 
 
-// Número máximo de argumentos de un comando
+// Argumentos de un comando que caben sin reservar memoria al analizarlo (si
+// tiene más, el vector crece en la arena)
 #define MAX_ARGS 16
 
 // Funciones maximo y minimo
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
-// Número máximo de procesos en segundo plano
-#define MAX_2PLANO 8
-
-// Delimitadores
-static const char WHITESPACE[] = " \t\r\n\v";
-// Caracteres especiales
-static const char SYMBOLS[] = "<|>&;()";
+// Tamaño máximo de los bloques de psplit (-s). Sin -s el límite es además
+// una fracción de la memoria libre (ver tam_bloque_psplit()).
+#define MAX_BSIZE_PSPLIT (8 << 20)
+
+// Con --sync=range, bytes de cada ventana de un fichero de salida de psplit
+// cuya escritura a disco se inicia de una vez
+#define VENTANA_SYNC_PSPLIT (8 << 20)
+
+// Clases de caracteres para el análisis léxico: delimitadores (" \t\r\n\v",
+// además del '\0' final) y caracteres especiales ("<|>&;()"). El resto de
+// caracteres forman parte de los argumentos.
+#define BLANCO  1
+#define SIMBOLO 2
+
+static const unsigned char CLASE[256] = {
+    ['\0'] = BLANCO, [' '] = BLANCO, ['\t'] = BLANCO, ['\r'] = BLANCO,
+    ['\n'] = BLANCO, ['\v'] = BLANCO,
+    ['<'] = SIMBOLO, ['|'] = SIMBOLO, ['>'] = SIMBOLO, ['&'] = SIMBOLO,
+    [';'] = SIMBOLO, ['('] = SIMBOLO, [')'] = SIMBOLO,
+};
 
 
 /******************************************************************************
@@ -122,11 +152,17 @@ void info(const char *fmt, ...)
 }
 
 
+// Número de errores notificados con `error` (permite saber si el análisis
+// sintáctico de una línea ha fallado)
+static unsigned long g_errores = 0;
+
 // Imprime el mensaje de error
 void error(const char *fmt, ...)
 {
     va_list arg;
 
+    g_errores++;
+
     fprintf(stderr, "%s: ", __FILE__);
     va_start(arg, fmt);
     vfprintf(stderr, fmt, arg);
@@ -148,14 +184,28 @@ void panic(const char *fmt, ...)
 }
 
 
-// `fork()` que muestra un mensaje de error si no se puede crear el hijo
+void olvidar_cola();
+extern FILE* g_entrada;
+
+// `fork()` que muestra un mensaje de error si no se puede crear el hijo. El
+// hijo no hereda la cola de trabajos en segundo plano que esperan hueco.
+//
+// Antes se descarta lo que quede en el búfer de la entrada no interactiva:
+// al terminar, exit() en el hijo devuelve con lseek() el descriptor a la
+// posición de la línea actual, y como el desplazamiento se comparte con el
+// padre, éste volvería a leer (y ejecutar) las líneas que ya tenía en el
+// búfer. Tras fflush() las posiciones coinciden y el hijo no mueve nada.
 int fork_or_panic(const char* s)
 {
     int pid;
 
+    if (g_entrada != NULL)
+        fflush(g_entrada);
     pid = fork();
     if(pid == -1)
         panic("%s failed: errno %d (%s)", s, errno, strerror(errno));
+    if (pid == 0)
+        olvidar_cola();
     return pid;
 }
 
@@ -180,16 +230,16 @@ int fork_or_panic(const char* s)
 // *casting* forzado de tipo. Se consigue así polimorfismo básico en C.
 
 // Valores del campo `type` de las estructuras de datos `cmd`
-enum cmd_type { EXEC=1, REDR=2, PIPE=3, LIST=4, BACK=5, SUBS=6, INV=7 };
+enum cmd_type { EXEC=1, REDR=2, PIPE=3, LIST=4, BACK=5, SUBS=6, TIME=7, INV=8 };
 
 struct cmd { enum cmd_type type; };
 
-// Comando con sus parámetros
+// Comando con sus parámetros. 'argv' tiene 'argc' + 1 elementos (el último
+// es NULL) y se reserva en la arena junto al propio nodo.
 struct execcmd {
     enum cmd_type type;
-    char* argv[MAX_ARGS];
-    char* eargv[MAX_ARGS];
     int argc;
+    char** argv;
 };
 
 // Comando con redirección
@@ -197,7 +247,6 @@ struct redrcmd {
     enum cmd_type type;
     struct cmd* cmd;
     char* file;
-    char* efile;
     int flags;
     mode_t mode;
     int fd;
@@ -229,6 +278,102 @@ struct subscmd {
     struct cmd* cmd;
 };
 
+// Formatos de salida de `time`
+#define TIEMPO_TEXTO 0
+#define TIEMPO_DATOS 1      // `time -d`: una línea JSON
+
+// Resto de la línea (o del subshell) cronometrado con `time`
+struct timecmd {
+    enum cmd_type type;
+    struct cmd* cmd;
+    int formato;
+};
+
+
+/******************************************************************************
+ * Arena para las estructuras de datos `cmd`
+ ******************************************************************************/
+
+
+// Todas las estructuras `cmd` de una línea de órdenes se reservan en una arena:
+// una lista de bloques de memoria que se van ocupando consecutivamente. Cuando
+// el árbol deja de hacer falta, la arena se reinicia de una vez (conservando
+// sus bloques para la siguiente línea) en lugar de liberar el árbol nodo a
+// nodo. Cada entrada de la caché de planes tiene su propia arena.
+
+#define TAM_BLOQUE_ARENA 4096
+
+struct bloque_arena {
+    struct bloque_arena* sig;
+    size_t tam;
+    size_t usado;
+    max_align_t datos[];
+};
+
+struct arena {
+    struct bloque_arena* primero;
+    struct bloque_arena* actual;
+};
+
+// Arena de la línea que se está analizando, de la que reservan los constructores
+struct arena* g_arena = NULL;
+
+// Devuelve 'tam' bytes (alineados para cualquier tipo) de la arena 'a'
+void* arena_reservar(struct arena* a, size_t tam)
+{
+    struct bloque_arena* b;
+
+    tam = (tam + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    // Bloques ya reservados en un uso anterior de la arena
+    for (b = a->actual; b != NULL && b->usado + tam > b->tam; b = b->sig)
+        b->usado = b->tam;
+
+    if (b == NULL) {
+        size_t tam_bloque = MAX(tam, TAM_BLOQUE_ARENA);
+        if ((b = malloc(sizeof(*b) + tam_bloque)) == NULL)
+        {
+            perror("arena_reservar: malloc");
+            exit(EXIT_FAILURE);
+        }
+        b->sig = NULL;
+        b->tam = tam_bloque;
+        b->usado = 0;
+        if (a->actual != NULL) {
+            struct bloque_arena* ultimo = a->actual;
+            while (ultimo->sig != NULL)
+                ultimo = ultimo->sig;
+            ultimo->sig = b;
+        }
+        else
+            a->primero = b;
+    }
+
+    a->actual = b;
+    b->usado += tam;
+    return (char*) b->datos + b->usado - tam;
+}
+
+// Deja la arena vacía, conservando sus bloques
+void arena_reiniciar(struct arena* a)
+{
+    for (struct bloque_arena* b = a->primero; b != NULL; b = b->sig)
+        b->usado = 0;
+    a->actual = a->primero;
+}
+
+// Libera todos los bloques de la arena
+void arena_liberar(struct arena* a)
+{
+    struct bloque_arena* b;
+
+    while ((b = a->primero) != NULL) {
+        a->primero = b->sig;
+        free(b);
+    }
+    a->actual = NULL;
+}
+
 
 /******************************************************************************
  * Funciones para construir las estructuras de datos `cmd`
@@ -240,11 +385,7 @@ struct cmd* execcmd(void)
 {
     struct execcmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("execcmd: malloc");
-        exit(EXIT_FAILURE);
-    }
+    cmd = arena_reservar(g_arena, sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = EXEC;
 
@@ -253,21 +394,16 @@ struct cmd* execcmd(void)
 
 // Construye una estructura `cmd` de tipo `REDR`
 struct cmd* redrcmd(struct cmd* subcmd,
-        char* file, char* efile,
+        char* file,
         int flags, mode_t mode, int fd)
 {
     struct redrcmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("redrcmd: malloc");
-        exit(EXIT_FAILURE);
-    }
+    cmd = arena_reservar(g_arena, sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = REDR;
     cmd->cmd = subcmd;
     cmd->file = file;
-    cmd->efile = efile;
     cmd->flags = flags;
     cmd->mode = mode;
     cmd->fd = fd;
@@ -280,11 +416,7 @@ struct cmd* pipecmd(struct cmd* left, struct cmd* right)
 {
     struct pipecmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("pipecmd: malloc");
-        exit(EXIT_FAILURE);
-    }
+    cmd = arena_reservar(g_arena, sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = PIPE;
     cmd->left = left;
@@ -298,11 +430,7 @@ struct cmd* listcmd(struct cmd* left, struct cmd* right)
 {
     struct listcmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("listcmd: malloc");
-        exit(EXIT_FAILURE);
-    }
+    cmd = arena_reservar(g_arena, sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = LIST;
     cmd->left = left;
@@ -316,11 +444,7 @@ struct cmd* backcmd(struct cmd* subcmd)
 {
     struct backcmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("backcmd: malloc");
-        exit(EXIT_FAILURE);
-    }
+    cmd = arena_reservar(g_arena, sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = BACK;
     cmd->cmd = subcmd;
@@ -333,11 +457,7 @@ struct cmd* subscmd(struct cmd* subcmd)
 {
     struct subscmd* cmd;
 
-    if ((cmd = malloc(sizeof(*cmd))) == NULL)
-    {
-        perror("subscmd: malloc");
-        exit(EXIT_FAILURE);
-    }
+    cmd = arena_reservar(g_arena, sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = SUBS;
     cmd->cmd = subcmd;
@@ -345,6 +465,20 @@ struct cmd* subscmd(struct cmd* subcmd)
     return (struct cmd*) cmd;
 }
 
+// Construye una estructura `cmd` de tipo `TIME`
+struct cmd* timecmd(struct cmd* subcmd, int formato)
+{
+    struct timecmd* cmd;
+
+    cmd = arena_reservar(g_arena, sizeof(*cmd));
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->type = TIME;
+    cmd->cmd = subcmd;
+    cmd->formato = formato;
+
+    return (struct cmd*) cmd;
+}
+
 
 /******************************************************************************
  * Implementacion de comandos internos y manejador (Boletin 2/3/4)
@@ -352,19 +486,33 @@ struct cmd* subscmd(struct cmd* subcmd)
 
 // Declaracion previa para evitar conflictos
 struct cmd* cmd;
-void block_sigchld();
 void unblock_sigchld();
-
-void free_cmd(struct cmd* cmd);
+void notificar_fin_2plano(pid_t pid, int estado, struct rusage* ru);
+double segundos_desde(struct timespec* ini);
+void esperar_hijos(pid_t* pids, int n, int* estados);
+void esperar_pid(pid_t pid);
+void encolar_pid(pid_t pid);
+
+void run_cmd(struct cmd* cmd);
+void run_cmd_final(struct cmd* cmd);
+void run_time(struct timecmd* tcmd);
+void exec_cmd(struct execcmd* ecmd);
+char* strdup_o_panic(const char* s);
+int cmd_esInterno(char* cmd);
+extern int g_prompt_valido;
+void liberar_planes();
 
 char* comandosInternos[] = {
                             "cwd",
                             "exit",
                             "cd",
                             "psplit",
-                            "bjobs"
+                            "bjobs",
+                            "hash",
+                            "wait",
+                            "pmap"
                             };
-const int N_INTERNOS = 5;
+const int N_INTERNOS = 8;
 
 
 // Funcion interna que nos muestra el directorio actual
@@ -382,8 +530,7 @@ void run_cwd()
 
 void run_exit()
 {
-    free_cmd(cmd);
-    free(cmd);
+    liberar_planes();
 
     exit(EXIT_SUCCESS);
 }
@@ -444,10 +591,13 @@ void run_cd(struct execcmd* ecmd)
         if(chdir(ecmd->argv[1]))
             fprintf(stderr, "run_cd: No existe el directorio '%s'\n", ecmd->argv[1]);
     }
+
+    // El prompt muestra el directorio de trabajo
+    g_prompt_valido = 0;
 }
 
 char * help_psplit(){
-    return "Uso: psplit [-l NLINES] [-b NBYTES] [-s BSIZE] [-p PROCS] [FILE1] [FILE2]...\n\tOpciones:\n\t-l NLINES Número máximo de líneas por fichero.\n\t-b NBYTES Número máximo de bytes por fichero.\n\t-s BSIZE Tamaño en bytes de los bloques leídos de [FILEn] o stdin.\n\t-p PROCS Número máximo de procesos simultáneos.\n\t-h        Ayuda\n";
+    return "Uso: psplit [-l NLINES] [-b NBYTES] [-s BSIZE] [-p PROCS] [FILE1] [FILE2]...\n\tOpciones:\n\t-l NLINES Número máximo de líneas por fichero.\n\t-b NBYTES Número máximo de bytes por fichero.\n\t-s BSIZE Tamaño en bytes de los bloques leídos de [FILEn] o stdin (hasta 8 MiB).\n\t          Por defecto depende de la entrada (st_blksize, tamaño, capacidad de la tubería).\n\t-p PROCS Número máximo de procesos simultáneos.\n\t--sync=MODO Volcado a disco de los ficheros: always (fsync de cada fichero, por defecto),\n\t          end (syncfs al terminar), none (ninguno) o range (sync_file_range por ventanas de 8 MiB).\n\t--io=MOTOR Motor de entrada/salida: sync (por defecto) o uring (io_uring,\n\t          si el núcleo no lo admite se usa sync).\n\t-h        Ayuda\n";
 }
 
 // Funcion auxiliar que hemos usado para la implementación del comando psplit
@@ -473,376 +623,2644 @@ void nombreFichero(char * nombre, int indice, char * dst){
     strcat(dst, itoa(indice, base));
 }
 
-void do_psplit(int l, int b, int s, int fd, char * name){
-    char buffer [s+1];  // almacenará los datos leidos de fichero
-    char nombre_fich [NAME_MAX+1]; // + 1 porque no incluye el char \0 en la especificacion de NAME_MAX.
-
-    int offset, offset_W, indice;
-    /*
-     * 'offset_W' se utiliza para el error de write y para asegurarnos de que se escribe todo lo que deberia con write()
-     * 'offsset' se utiliza para adelantar el buffer en caso de que ya se haya escrito una parte de los bytes leidos
-    */
-    offset = offset_W = indice = 0;
+/*
+ * Búsqueda de saltos de línea para psplit -l
+ *
+ * buscar_saltos(buffer, n, l, &saltos) recorre 'buffer[0..n)' contando saltos
+ * de línea a partir de los 'saltos' ya vistos. Devuelve la posición siguiente
+ * al salto que hace 'saltos == l', o 'n' si el bloque se acaba antes, y deja
+ * en 'saltos' la cuenta actualizada. Si 'n > 0' consume siempre al menos un
+ * byte, como el bucle original de do_psplit(), para que los bucles que la
+ * llaman hasta agotar el bloque terminen aunque 'l' sea 0.
+ *
+ * Hay una versión escalar y, en x86, versiones SSE2 y AVX2 que comparan 16 o
+ * 32 bytes a la vez y cuentan los saltos con popcount sobre la máscara. La
+ * versión se elige en tiempo de ejecución la primera vez que se llama.
+ */
 
-    // Primer fichero que se crea
-    nombreFichero(name, indice, nombre_fich);
-    int fd_i;
-    if ((fd_i = open(nombre_fich , O_RDWR | O_CREAT | O_TRUNC, S_IRWXU)) == -1){
-        perror("do_psplit (open)");
-        exit(EXIT_FAILURE);
-    }
+size_t buscar_saltos_escalar(const char * buffer, size_t n, int l, int * saltos){
+    size_t i = 0;
 
-    int b_escribir = b;	// bytes a escribir en cada iteracion de lectura, para la opcion -b
-    int i, saltos;  // variables que se usaran para la opcion -l
-    i = saltos = 0;
-    int bytesLeidos = 0;    // bytes que leemos con read()
+    if (n == 0)
+        return 0;
+    do {
+        if (buffer[i++] == '\n')
+            (*saltos)++;
+    } while (i < n && *saltos < l);
+    return i;
+}
 
-    while ((bytesLeidos = read(fd, buffer, s))) {
-        if(b){
-            offset = 0;	
-            while (bytesLeidos > 0) {
-                if (!b_escribir) {
-                    if (fsync(fd_i)){
-                        perror("do_psplit (fsync)");
-                        exit(EXIT_FAILURE);
-                    }
-                    TRY ( close(fd_i) );
-                    indice++;
-                    nombreFichero(name, indice, nombre_fich);
-                    if ((fd_i = open(nombre_fich , O_RDWR | O_CREAT | O_TRUNC, S_IRWXU)) == -1){
-                        perror("do_psplit (open)");
-                        exit(EXIT_FAILURE);
-                    }
-                    b_escribir = b;	// volvemos a establecer que hay que escribir un total de 'b' bytes
-                }
-                offset_W = 0;
-                // El minimo se calcula para que no se intenten escribir mas caracteres de la cuenta.
-                while( (offset_W += write(fd_i, buffer+offset+offset_W, MIN(bytesLeidos, b_escribir)-offset_W )) != MIN(bytesLeidos, b_escribir) ){
-                    if(offset_W < 0)
-                    {
-                        perror("write");
-                        exit(EXIT_FAILURE);
-                    }
-                }
+#if defined(__x86_64__) || defined(__i386__)
+// Dada la máscara 'm' de un bloque con al menos 'k' saltos, devuelve la
+// posición del k-ésimo
+static inline int k_esimo_bit(unsigned m, int k){
+    while (--k)
+        m &= m - 1;
+    return __builtin_ctz(m);
+}
 
-                offset += offset_W;
-                b_escribir -= offset_W;
-                bytesLeidos -= offset_W;
-            }
+__attribute__((target("sse2")))
+size_t buscar_saltos_sse2(const char * buffer, size_t n, int l, int * saltos){
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    unsigned m;
+    int c;
+
+    for (; i + 16 <= n && *saltos < l; i += 16) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (buffer + i)), nl));
+        if (*saltos + (c = __builtin_popcount(m)) >= l) {
+            i += k_esimo_bit(m, l - *saltos) + 1;
+            *saltos = l;
+            return i;
         }
-        else{
-            i = 0;
-            offset = 0;
-            while(i < bytesLeidos){
-                if(saltos == l){
-                    if(fsync(fd_i)){
-                        perror("do_psplit (fsync)");
-                        exit(EXIT_FAILURE);
-                    }
-                    TRY( close(fd_i) );
-                    indice++;
-                    nombreFichero(name, indice, nombre_fich);
-                    if ((fd_i = open(nombre_fich , O_RDWR | O_CREAT | O_TRUNC, S_IRWXU)) == -1){
-                        perror("do_psplit (open)");
-                        exit(EXIT_FAILURE);
-                    }
-                    saltos = 0;
-                }
-                
-                do{
-                    if(buffer[i] == '\n')
-                        saltos++; 
-                    i++;
-                }while((i < bytesLeidos) && (saltos < l));
-
-                offset_W = 0;
-                while( (offset_W += write(fd_i, buffer+offset+offset_W, i-offset-offset_W )) != i-offset ){
-                    if(offset_W < 0)
-                    {
-                        perror("write");
-                        exit(EXIT_FAILURE);
-                    }
-                }
-                offset = i;
-            }
+        *saltos += c;
+    }
+    return i + buscar_saltos_escalar(buffer + i, n - i, l, saltos);
+}
+
+__attribute__((target("avx2")))
+size_t buscar_saltos_avx2(const char * buffer, size_t n, int l, int * saltos){
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    unsigned m;
+    int c;
+
+    for (; i + 32 <= n && *saltos < l; i += 32) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (buffer + i)), nl));
+        if (*saltos + (c = __builtin_popcount(m)) >= l) {
+            i += k_esimo_bit(m, l - *saltos) + 1;
+            *saltos = l;
+            return i;
         }
+        *saltos += c;
     }
-    if (fsync(fd_i)){
-        perror("do_psplit (fsync)");
-        exit(EXIT_FAILURE);
+    return i + buscar_saltos_sse2(buffer + i, n - i, l, saltos);
+}
+#endif
+
+size_t (*buscar_saltos_impl)(const char *, size_t, int, int *) = NULL;
+
+size_t buscar_saltos(const char * buffer, size_t n, int l, int * saltos){
+    if (!buscar_saltos_impl) {
+        buscar_saltos_impl = buscar_saltos_escalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            buscar_saltos_impl = buscar_saltos_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            buscar_saltos_impl = buscar_saltos_sse2;
+#endif
     }
-    TRY ( close(fd_i) );
+    return buscar_saltos_impl(buffer, n, l, saltos);
 }
 
-void run_psplit(struct execcmd* ecmd)
-{
-    char errPsplit[] = {'s','p','l','b'};
-    const int MAX_BUF_SIZE = pow(2, 20);
-	int opt, l, b, s, p, error, flag_b, flag_l;
-    l = b = error = flag_l = flag_b = 0;
-    s = 1024;
-    p = 1;
-    optind = 1;
-    while (!error && (opt = getopt(ecmd->argc, ecmd->argv, "l:b:s:p:h")) != -1) {
-        switch (opt) {
-            case 'l':
-                if(flag_b) error = 1;
-                else{
-                    l = atoi(optarg);
-                    if(l <= 0) error = 4;
-                    else
-                        flag_l = 1;
-                }
-                break;
-            case 'b':
-                if(flag_l) error = 1;
-                else{
-                    b = atoi(optarg);
-                    if(b <= 0) error = 5;
-                    else
-                        flag_b = 1;
-                }
-                break;
-            case 's':
-                s = atoi(optarg);
-                if(s <= 0 || s > MAX_BUF_SIZE) error = 2;
-                break;
-            case 'p':
-                p = atoi(optarg);
-                if(p <= 0) error = 3;
-                break;
-            case 'h':
-                printf("%s\n", help_psplit());
-                return;
-                break;
-            default:
-                fprintf(stderr, "Uso: psplit [-l NLINES] [-b NBYTES] [-s BSIZE] [-p PROCS] [FILE1] [FILE2]...\n");
-        }
+// Reserva un bloque de 's' bytes alineado a página para las lecturas de psplit
+char * reservar_bloque(size_t s){
+    void * bloque;
+
+    if ((errno = posix_memalign(&bloque, sysconf(_SC_PAGESIZE), s))){
+        perror("do_psplit: posix_memalign");
+        exit(EXIT_FAILURE);
     }
-    switch(error){
-        case 1:
-            fprintf(stderr, "psplit: Opciones incompatibles\n");
-            break;
-        case 2:
-        case 3:
-        case 4:
-        case 5:
-            fprintf(stderr, "psplit: Opción -%c no válida\n", errPsplit[error-2]);
-            break;
+    return bloque;
+}
+
+// Tamaño de bloque de psplit cuando no se indica -s, según el tipo de entrada:
+//   - tubería: su capacidad (F_GETPIPE_SZ), que es lo más que devuelve un read()
+//   - fichero regular: el tamaño del fichero redondeado a st_blksize
+//   - otros (terminales, sockets...): st_blksize
+// En todos los casos, hasta MAX_BSIZE_PSPLIT y 1/64 de la memoria libre: el
+// motor io_uring mantiene URING_BUFFERS bloques a la vez.
+int tam_bloque_psplit(int fd){
+    struct stat st;
+    long blk, s, max;
+
+    if (fstat(fd, &st) == -1){
+        perror("do_psplit (fstat)");
+        exit(EXIT_FAILURE);
     }
-    if(!error){
+    blk = st.st_blksize > 0 ? st.st_blksize : sysconf(_SC_PAGESIZE);
 
-        if(optind == ecmd->argc){   // No mas argumentos que leer => lectura de la entrada estándar
-            char * file_in = "stdin";
-            do_psplit(l, b, s, STDIN_FILENO, file_in);
-        }
-        else {  // Procesamiento de los ficheros en paralelo según la opción -p
-            pid_t procs_psplit[p];
-            int cola, cabeza;
-            cola = cabeza = 0;
-            int BPROCS = p;
-            int fd;
-
-            block_sigchld();
-
-            for(int i = optind; i < ecmd->argc; i++){
-                if(BPROCS > 0) {    // Cuando aún tenemos opción de lanzar más en paralelo
-                    if((procs_psplit[cabeza] = fork_or_panic("fork psplit")) == 0){
-                        if ((fd = open(ecmd->argv[i], O_RDONLY, S_IRWXU)) == -1){
-                            perror("run_psplit (open)");
-                            exit(EXIT_FAILURE);
-                        }
-                        do_psplit(l, b, s, fd, ecmd->argv[i]);
-                        TRY ( close(fd) );
-                        exit(EXIT_SUCCESS);
-                    }
-                    BPROCS--;
-                    cabeza = (cabeza + 1) % p;
-                }
-                else {  // Primero debemos esperar que finalice el más antiguo
-                    if (waitpid(procs_psplit[cola], 0, 0) == -1){
-                        perror("run_psplit (waitpid)");
-                        exit(EXIT_FAILURE);
-                    }
-                    cola = (cola + 1) % p;
-                    if((procs_psplit[cabeza] = fork_or_panic("fork psplit")) == 0){
-                        if ((fd = open(ecmd->argv[i], O_RDONLY, S_IRWXU)) == -1){
-                            perror("run_psplit (open)");
-                            exit(EXIT_FAILURE);
-                        }
-                        do_psplit(l, b, s, fd, ecmd->argv[i]);
-                        TRY ( close(fd) );
-                        exit(EXIT_SUCCESS);
-                    }
-                    cabeza = (cabeza + 1) % p;
-                }
-            }
+    if (S_ISFIFO(st.st_mode) && (s = fcntl(fd, F_GETPIPE_SZ)) > 0)
+        ;
+    else if (S_ISREG(st.st_mode))
+        s = (st.st_size + blk - 1) / blk * blk;
+    else
+        s = blk;
 
-            // Esperamos en orden a que acaben todos los procesos en paralelo
-            for(int i = 0; i < MIN(p, ecmd->argc - optind); i++){
-                if (waitpid(procs_psplit[cola], 0, 0) == -1){
-                    perror("run_psplit (waitpid)");
-                    exit(EXIT_FAILURE);
-                }
-                cola = (cola + 1) % p;
-            }
-        }
+    max = MIN(MAX_BSIZE_PSPLIT, sysconf(_SC_AVPHYS_PAGES) / 64 * sysconf(_SC_PAGESIZE));
+    s = MAX(blk, MIN(s, max));
+    DPRINTF(DBG_TRACE, "tamaño de bloque automático: %ld bytes\n", s);
+    return s;
+}
 
-        unblock_sigchld();
+// Fichero de salida que se está escribiendo (--sync=range)
+struct ventana_sync {
+    int fd;
+    off_t escrito;      // bytes escritos
+    off_t ventana;      // inicio de la primera ventana sin iniciar
+};
+struct ventana_sync g_ventana_sync = { -1, 0, 0 };
+
+// Abre (creando o truncando) el fichero de salida número 'indice' de 'name'
+// y deja su nombre en 'nombre_fich'
+int abrir_trozo(char * name, int indice, char * nombre_fich){
+    int fd_i;
 
+    nombreFichero(name, indice, nombre_fich);
+    if ((fd_i = open(nombre_fich , O_RDWR | O_CREAT | O_TRUNC, S_IRWXU)) == -1){
+        perror("do_psplit (open)");
+        exit(EXIT_FAILURE);
     }
+    g_ventana_sync = (struct ventana_sync) { fd_i, 0, 0 };
+    return fd_i;
 }
 
-// 'PIDS' almacenará el PID de los procesos que se estén ejecutando en segundo plano
-pid_t PIDS[MAX_2PLANO] = {-1, -1, -1, -1, -1, -1, -1, -1};
-
-// guardar_pid(pid) asume que siempre habrá espacio en PIDS para almacenar 'pid'
-void guardar_pid(pid_t pid)
-{   
-    int i = 0;
-    while(i < MAX_2PLANO && PIDS[i]!= -1)
-        i++;
-    PIDS[i] = pid;
+// Políticas de volcado a disco de los ficheros de salida de psplit (--sync)
+//   - SYNC_ALWAYS: fsync() de cada fichero antes de cerrarlo
+//   - SYNC_END:    un único syncfs() por sistema de ficheros al acabar psplit
+//   - SYNC_NONE:   ninguno, se deja al núcleo
+//   - SYNC_RANGE:  sync_file_range() por ventanas de VENTANA_SYNC_PSPLIT
+//                  bytes según se escribe cada fichero: se inicia la escritura
+//                  de cada ventana y se espera a la de la ventana anterior, de
+//                  modo que la escritura a disco pendiente está acotada
+enum sync_psplit { SYNC_ALWAYS, SYNC_END, SYNC_NONE, SYNC_RANGE };
+const char * nombres_sync[] = { "always", "end", "none", "range" };
+enum sync_psplit g_psplit_sync = SYNC_ALWAYS;
+
+// Motor de entrada/salida de psplit (--io): síncrono o io_uring
+enum io_psplit { IO_SYNC, IO_URING };
+const char * nombres_io[] = { "sync", "uring" };
+enum io_psplit g_psplit_io = IO_SYNC;
+
+// sync_file_range() sobre 'len' bytes desde 'ini' (0: hasta el final)
+void sync_rango(int fd, off_t ini, off_t len, unsigned flags){
+    if (sync_file_range(fd, ini, len, flags)){
+        perror("do_psplit (sync_file_range)");
+        exit(EXIT_FAILURE);
+    }
 }
 
-// eliminar_pid(pid) asume que el 'pid' especificado como argumento esté dentro de PIDS
-void eliminar_pid(pid_t pid)
-{
-    int i = 0;
-    while(i < MAX_2PLANO && PIDS[i]!= pid)
-        i++;
-    PIDS[i] = -1;
+// Bytes que se escriben de una vez: con --sync=range, como mucho una ventana
+size_t max_escritura(size_t n){
+    return g_psplit_sync == SYNC_RANGE ? MIN(n, VENTANA_SYNC_PSPLIT) : n;
 }
 
-// muestra todos los PIDS que tenemos almacenados en 'PIDS'
-void listar_pids()
-{
-    for (int i = 0; i < MAX_2PLANO; ++i)
-        if (PIDS[i] != -1)
-            printf("[%d]\n", PIDS[i]);
+// --sync=range: anota 'n' bytes más escritos en 'fd'. Por cada ventana
+// completa inicia su escritura a disco y espera a la de la ventana anterior.
+void volcar_ventanas(int fd, size_t n){
+    struct ventana_sync * v = &g_ventana_sync;
+
+    if (g_psplit_sync != SYNC_RANGE || fd != v->fd)
+        return;
+    for (v->escrito += n; v->escrito - v->ventana >= VENTANA_SYNC_PSPLIT; v->ventana += VENTANA_SYNC_PSPLIT) {
+        sync_rango(fd, v->ventana, VENTANA_SYNC_PSPLIT, SYNC_FILE_RANGE_WRITE);
+        if (v->ventana > 0)
+            sync_rango(fd, v->ventana - VENTANA_SYNC_PSPLIT, VENTANA_SYNC_PSPLIT,
+                       SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
 }
 
-// envia la señal SIGKILL a todos los procesos cuyo PID se encuentre almacenado en 'PIDS'
-void matarTodos_pids()
-{
-    for (int i = 0; i < MAX_2PLANO; ++i)
-        if (PIDS[i] != -1)
-            if (kill(PIDS[i], SIGKILL) == -1){
-                perror("kill");
+// Vuelca a disco (según --sync) y cierra un fichero de salida de psplit
+void cerrar_trozo(int fd_i){
+    switch (g_psplit_sync) {
+        case SYNC_ALWAYS:
+            if (fsync(fd_i)){
+                perror("do_psplit (fsync)");
                 exit(EXIT_FAILURE);
             }
+            break;
+        case SYNC_RANGE:
+            // Las ventanas completas ya se han iniciado: queda el final
+            sync_rango(fd_i, fd_i == g_ventana_sync.fd ? g_ventana_sync.ventana : 0, 0, SYNC_FILE_RANGE_WRITE);
+            break;
+        case SYNC_END:
+        case SYNC_NONE:
+            break;
+    }
+    if (fd_i == g_ventana_sync.fd)
+        g_ventana_sync.fd = -1;
+    TRY ( close(fd_i) );
 }
 
-// Metodo para añadir '[]' directamente a un entero en base 10
-char* itoa_con_corchetes(int val){
-    static char buf[32] = {0};
-    
-    buf[30] = '\n';
-    buf[29] = ']';
-    int i = 28;
-    for(; val && i ; --i, val /= 10)
-        buf[i] = "0123456789"[val % 10];
-    buf[i] = '[';
-    
-    return &buf[i];
-}
-
-// Manejador de señal SIGCHLD
-void handle_sigchld(int sig) {
-    int saved_errno = errno;
-    pid_t pid = 0;
-    int len, offset;
-
-    while((pid = waitpid((pid_t)(-1), 0, WNOHANG)) > 0){
-        char * proc = itoa_con_corchetes(pid);
-        len = strlen(proc);
-
-        offset = 0;
-        while ((offset += write(STDOUT_FILENO, proc+offset, len)) != len){
-            len -= offset;
-            if(offset < 0)
-            {
-                perror("write");
+// --sync=end: vuelca de una vez los sistemas de ficheros donde se han escrito
+// los ficheros de salida de los prefijos 'nombres[0..n)'
+void sincronizar_psplit(char ** nombres, int n){
+    dev_t hechos[n];
+    int n_hechos = 0, fd, i;
+    struct stat st;
+    char dir [PATH_MAX];
+
+    for (int k = 0; k < n; k++) {
+        strncpy(dir, nombres[k], PATH_MAX - 1);
+        dir[PATH_MAX - 1] = 0;
+        if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) == -1){
+            perror("psplit (open)");
+            continue;
+        }
+        if (fstat(fd, &st) == -1){
+            perror("psplit (fstat)");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n_hechos && hechos[i] != st.st_dev; i++)
+            ;
+        if (i == n_hechos) {
+            if (syncfs(fd)){
+                perror("psplit (syncfs)");
                 exit(EXIT_FAILURE);
             }
+            hechos[n_hechos++] = st.st_dev;
         }
-
-        eliminar_pid(pid);
+        TRY ( close(fd) );
     }
-
-    errno = saved_errno;
 }
 
-// Funciones para bloquear y desbloquear la señal SIGCHLD
+// Escribe los 'n' bytes de 'buffer' en 'fd' aunque write() escriba menos de lo pedido
+void escribir_todo(int fd, const char * buffer, size_t n){
+    ssize_t escritos;
 
-void block_sigchld(){
-    // Preparamos la máscara para bloquear la señal sigchld
-    sigset_t blocked_signals_CHLD;
-    if (sigemptyset(&blocked_signals_CHLD) == -1) {
-        perror("sigemptyset");
-        exit(EXIT_FAILURE);
-    }
-    if (sigaddset(&blocked_signals_CHLD, SIGCHLD)){
-        perror("sigaddset");
-        exit(EXIT_FAILURE);
-    }
-    
-    // Bloqueamos la señale SIGCHLD
-    if(sigprocmask(SIG_BLOCK, &blocked_signals_CHLD, NULL) == -1){
-        perror("sigprocmask (block SIGCHLD)");
-        exit(EXIT_FAILURE);
+    while (n > 0) {
+        if ((escritos = write(fd, buffer, max_escritura(n))) < 0){
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        volcar_ventanas(fd, escritos);
+        buffer += escritos;
+        n -= escritos;
     }
 }
 
-void unblock_sigchld(){
-    sigset_t blocked_signals_CHLD;
-    if (sigemptyset(&blocked_signals_CHLD) == -1) {
-        perror("sigemptyset");
-        exit(EXIT_FAILURE);
-    }
-    if (sigaddset(&blocked_signals_CHLD, SIGCHLD)){
-        perror("sigaddset");
-        exit(EXIT_FAILURE);
-    }
-    
-    // Desbloqueamos la señale SIGCHLD
-    if(sigprocmask(SIG_UNBLOCK, &blocked_signals_CHLD, NULL) == -1){
-        perror("sigprocmask (unblock SIGCHLD)");
+// Formas de mover los datos de la entrada a los ficheros de salida con -b
+enum modo_copia { COPIA_READ, COPIA_RANGE, COPIA_SPLICE };
+
+// Copia hasta 'n' bytes de 'fd_in' a 'fd_out' dentro del núcleo, sin pasar
+// por un buffer de usuario: copy_file_range() entre ficheros regulares y
+// splice() cuando uno de los dos es una tubería.
+// Devuelve los bytes copiados, 0 al llegar al final de la entrada o -1 si el
+// núcleo no admite la copia para estos descriptores. En ese último caso no se
+// ha consumido nada de 'fd_in' y se puede seguir con read()/write().
+ssize_t copiar_kernel(int fd_in, int fd_out, size_t n, enum modo_copia modo){
+    ssize_t copiados;
+
+    n = max_escritura(n);
+    do {
+        if (modo == COPIA_RANGE)
+            copiados = copy_file_range(fd_in, NULL, fd_out, NULL, n, 0);
+        else
+            copiados = splice(fd_in, NULL, fd_out, NULL, n, SPLICE_F_MOVE);
+    } while (copiados == -1 && errno == EINTR);
+
+    if (copiados == -1) {
+        if (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP)
+            return -1;
+        perror(modo == COPIA_RANGE ? "do_psplit (copy_file_range)" : "do_psplit (splice)");
         exit(EXIT_FAILURE);
     }
+    volcar_ventanas(fd_out, copiados);
+    return copiados;
 }
 
+// psplit -b: trocea la entrada en ficheros de 'b' bytes.
+// Intenta primero la copia dentro del núcleo y, si no es posible, lee bloques
+// de 's' bytes con read() y los escribe con write().
+void do_psplit_bytes(int b, int s, int fd, char * name){
+    char nombre_fich [NAME_MAX+1];
+    struct stat st;
+    enum modo_copia modo;
+    int indice = 0;
+    int b_escribir = b;    // bytes que quedan por escribir en el fichero actual
+    int tub[2] = {-1, -1}; // tubería intermedia para splice()
+    ssize_t n, m;
+
+    if (fstat(fd, &st) == -1){
+        perror("do_psplit (fstat)");
+        exit(EXIT_FAILURE);
+    }
+    modo = S_ISREG(st.st_mode) ? COPIA_RANGE : COPIA_SPLICE;
+    if (modo == COPIA_SPLICE && pipe(tub) == -1)
+        modo = COPIA_READ;
 
-char * help_bjobs()
-{
-    return "Uso : bjobs [ - k ] [ - h ]\n\tOpciones :\n\t-k Mata todos los procesos en segundo plano.\n\t-h Ayuda\n";
-}
-
-void run_bjobs(struct execcmd* ecmd)
-{
-    int opt, error, flag_k;
-    opt = error = flag_k = 0;
+    int fd_i = abrir_trozo(name, indice, nombre_fich);
 
-    optind = 1;
-    while (!error && (opt = getopt(ecmd->argc, ecmd->argv, "kh")) != -1) {
-        switch (opt) {
-            case 'k':
-                flag_k = 1;
+    // Ficheros regulares: copy_file_range() directamente al fichero de salida.
+    // Sólo se crea el siguiente fichero si quedan datos en la entrada.
+    while (modo == COPIA_RANGE) {
+        if (!b_escribir) {
+            if (lseek(fd, 0, SEEK_CUR) >= st.st_size)
                 break;
-            case 'h':
-                printf("%s\n", help_bjobs());
+            cerrar_trozo(fd_i);
+            fd_i = abrir_trozo(name, ++indice, nombre_fich);
+            b_escribir = b;
+        }
+        if ((n = copiar_kernel(fd, fd_i, b_escribir, modo)) == -1)
+            modo = COPIA_READ;
+        else if (n == 0)
+            break;
+        else
+            b_escribir -= n;
+    }
+
+    // Resto de entradas: splice() a una tubería intermedia y de ella al fichero
+    // de salida. Así se sabe si quedan datos antes de crear el siguiente fichero.
+    while (modo == COPIA_SPLICE) {
+        if ((n = copiar_kernel(fd, tub[1], b_escribir ? b_escribir : b, modo)) == -1) {
+            modo = COPIA_READ;
+            break;
+        }
+        if (n == 0)
+            break;
+        if (!b_escribir) {
+            cerrar_trozo(fd_i);
+            fd_i = abrir_trozo(name, ++indice, nombre_fich);
+            b_escribir = b;
+        }
+        b_escribir -= n;
+        while (n > 0) {
+            if ((m = copiar_kernel(tub[0], fd_i, n, modo)) <= 0) {
+                // El fichero de salida no admite splice(): se vacía la
+                // tubería intermedia a mano y se sigue con read()/write()
+                char resto [n];
+                if (read(tub[0], resto, n) != n){
+                    perror("do_psplit (read)");
+                    exit(EXIT_FAILURE);
+                }
+                escribir_todo(fd_i, resto, n);
+                modo = COPIA_READ;
+                break;
+            }
+            n -= m;
+        }
+    }
+    if (tub[0] != -1) {
+        TRY ( close(tub[0]) );
+        TRY ( close(tub[1]) );
+    }
+
+    if (modo == COPIA_READ) {
+        char * buffer = reservar_bloque(s);
+        int bytesLeidos, offset, bloque;
+
+        while ((bytesLeidos = read(fd, buffer, s)) > 0) {
+            offset = 0;
+            while (bytesLeidos > 0) {
+                if (!b_escribir) {
+                    cerrar_trozo(fd_i);
+                    fd_i = abrir_trozo(name, ++indice, nombre_fich);
+                    b_escribir = b;	// volvemos a establecer que hay que escribir un total de 'b' bytes
+                }
+                // El minimo se calcula para que no se intenten escribir mas caracteres de la cuenta.
+                bloque = MIN(bytesLeidos, b_escribir);
+                escribir_todo(fd_i, buffer + offset, bloque);
+
+                offset += bloque;
+                b_escribir -= bloque;
+                bytesLeidos -= bloque;
+            }
+        }
+        if (bytesLeidos < 0){
+            perror("do_psplit (read)");
+            exit(EXIT_FAILURE);
+        }
+        free(buffer);
+    }
+    cerrar_trozo(fd_i);
+}
+
+// psplit -l sobre ficheros regulares: proyecta la entrada en memoria,
+// localiza los límites de cada trozo sobre la proyección y escribe cada
+// fichero de salida de una vez. El número de llamadas al sistema depende así
+// del número de ficheros generados y no del tamaño de la entrada.
+// Devuelve 0 si la entrada no se puede proyectar y hay que usar read().
+int do_psplit_lineas_mmap(int l, int fd, char * name){
+    char nombre_fich [NAME_MAX+1];
+    struct stat st;
+    off_t inicio;
+    char *base, *p, *fin, *trozo;
+    int fd_i, saltos, indice = 0;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return 0;
+    // Se respeta la posición actual del descriptor (p.ej. stdin redirigido)
+    if ((inicio = lseek(fd, 0, SEEK_CUR)) == -1 || inicio >= st.st_size)
+        return 0;
+    if ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        return 0;
+    if (madvise(base, st.st_size, MADV_SEQUENTIAL) == -1){
+        perror("do_psplit (madvise)");
+        exit(EXIT_FAILURE);
+    }
+
+    p = base + inicio;
+    fin = base + st.st_size;
+    do {
+        // El trozo acaba tras el l-ésimo salto de línea o al final del fichero
+        trozo = p;
+        saltos = 0;
+        p += buscar_saltos(p, fin - p, l, &saltos);
+
+        fd_i = abrir_trozo(name, indice++, nombre_fich);
+        escribir_todo(fd_i, trozo, p - trozo);
+        cerrar_trozo(fd_i);
+    } while (p < fin);
+
+    TRY ( munmap(base, st.st_size) );
+    // Deja el descriptor al final, igual que si se hubiera leído con read()
+    TRY ( lseek(fd, st.st_size, SEEK_SET) );
+    return 1;
+}
+
+/*
+ * Motor io_uring de psplit (--io=uring)
+ *
+ * En lugar de leer un bloque, escribirlo y volver a leer, se mantienen varias
+ * lecturas y escrituras en vuelo sobre un anillo io_uring:
+ *   - URING_BUFFERS bloques de 's' bytes registrados en el núcleo
+ *     (READ_FIXED/WRITE_FIXED). Si no se pueden registrar se usan READ/WRITE.
+ *   - Con ficheros regulares hay varias lecturas en vuelo a la vez, cada una
+ *     con su desplazamiento. Con tuberías y terminales, una sola lectura, pero
+ *     las escrituras de los bloques anteriores siguen en vuelo mientras tanto.
+ *   - Los bloques se trocean en orden. Cada trozo de un bloque se escribe en
+ *     su fichero de salida con su desplazamiento dentro de ese fichero.
+ *   - Cuando un fichero de salida está completo y sus escrituras han acabado,
+ *     se envía su fsync (o sync_file_range, según --sync) enlazado con el
+ *     close (IOSQE_IO_LINK).
+ *   - Con --sync=range, además, por cada ventana de VENTANA_SYNC_PSPLIT bytes
+ *     escrita se envía un sync_file_range que inicia su escritura a disco y
+ *     otro que espera a la ventana anterior. Mientras tanto no se envían más
+ *     escrituras a ese fichero.
+ * Los ficheros de salida se abren con open() porque las escrituras siguientes
+ * necesitan su descriptor.
+ */
+
+#define URING_ENTRADAS 64
+#define URING_BUFFERS  8
+
+// Anillo io_uring usado directamente con las llamadas al sistema
+struct anillo {
+    int fd;
+    unsigned entradas;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_tail_local;     // SQEs preparadas, aún no publicadas
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    void * sq_ptr;
+    void * cq_ptr;
+    size_t sq_tam, cq_tam, sqes_tam;
+    unsigned en_vuelo;          // SQEs cuya CQE no se ha recogido todavía
+};
+
+// Crea el anillo. Devuelve 0 si el núcleo no admite io_uring.
+int anillo_iniciar(struct anillo * a, unsigned entradas){
+    struct io_uring_params p;
+
+    memset(a, 0, sizeof(*a));
+    memset(&p, 0, sizeof(p));
+    if ((a->fd = syscall(__NR_io_uring_setup, entradas, &p)) == -1)
+        return 0;
+    // Sin IORING_FEAT_NODROP el núcleo podría perder CQEs
+    if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+        TRY ( close(a->fd) );
+        return 0;
+    }
+
+    a->entradas = p.sq_entries;
+    a->sq_tam = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    a->cq_tam = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        a->sq_tam = a->cq_tam = MAX(a->sq_tam, a->cq_tam);
+    a->sqes_tam = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    a->sq_ptr = mmap(NULL, a->sq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQ_RING);
+    a->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? a->sq_ptr :
+        mmap(NULL, a->cq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_CQ_RING);
+    a->sqes = mmap(NULL, a->sqes_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQES);
+    if (a->sq_ptr == MAP_FAILED || a->cq_ptr == MAP_FAILED || a->sqes == MAP_FAILED){
+        perror("do_psplit (mmap io_uring)");
+        exit(EXIT_FAILURE);
+    }
+
+    a->sq_head  = (unsigned *) ((char *) a->sq_ptr + p.sq_off.head);
+    a->sq_tail  = (unsigned *) ((char *) a->sq_ptr + p.sq_off.tail);
+    a->sq_mask  = (unsigned *) ((char *) a->sq_ptr + p.sq_off.ring_mask);
+    a->sq_array = (unsigned *) ((char *) a->sq_ptr + p.sq_off.array);
+    a->cq_head  = (unsigned *) ((char *) a->cq_ptr + p.cq_off.head);
+    a->cq_tail  = (unsigned *) ((char *) a->cq_ptr + p.cq_off.tail);
+    a->cq_mask  = (unsigned *) ((char *) a->cq_ptr + p.cq_off.ring_mask);
+    a->cqes     = (struct io_uring_cqe *) ((char *) a->cq_ptr + p.cq_off.cqes);
+    a->sq_tail_local = *a->sq_tail;
+    return 1;
+}
+
+void anillo_liberar(struct anillo * a){
+    TRY ( munmap(a->sqes, a->sqes_tam) );
+    if (a->cq_ptr != a->sq_ptr)
+        TRY ( munmap(a->cq_ptr, a->cq_tam) );
+    TRY ( munmap(a->sq_ptr, a->sq_tam) );
+    TRY ( close(a->fd) );
+}
+
+// Huecos libres para nuevas SQEs sin arriesgar a desbordar la cola de CQEs
+int anillo_libres(struct anillo * a){
+    return a->entradas - a->en_vuelo;
+}
+
+// Devuelve la siguiente SQE, vacía. Sólo se llama si anillo_libres() > 0.
+struct io_uring_sqe * anillo_sqe(struct anillo * a, __u8 opcode, int fd, void * datos){
+    unsigned idx = a->sq_tail_local++ & *a->sq_mask;
+    struct io_uring_sqe * sqe = &a->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (__u64) (uintptr_t) datos;
+    a->sq_array[idx] = idx;
+    a->en_vuelo++;
+    return sqe;
+}
+
+// Envía las SQEs preparadas y espera a que haya al menos 'esperar' CQEs
+void anillo_enviar(struct anillo * a, unsigned esperar){
+    unsigned enviar;
+    int ret;
+
+    __atomic_store_n(a->sq_tail, a->sq_tail_local, __ATOMIC_RELEASE);
+    enviar = a->sq_tail_local - __atomic_load_n(a->sq_head, __ATOMIC_ACQUIRE);
+    do {
+        ret = syscall(__NR_io_uring_enter, a->fd, enviar, esperar,
+                      esperar ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1){
+        perror("do_psplit (io_uring_enter)");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Operaciones en vuelo del motor io_uring
+enum op_uring { OP_LEER, OP_ESCRIBIR, OP_SYNC, OP_CERRAR };
+
+struct peticion_uring {
+    enum op_uring op;
+    int buf;            // OP_LEER, OP_ESCRIBIR
+    long trozo;         // OP_ESCRIBIR, OP_SYNC, OP_CERRAR
+    int off;            // posición dentro del bloque
+    int len;            // OP_SYNC: distinto de 0 si espera a una ventana
+    off_t foff;         // desplazamiento en el fichero
+};
+
+// Estado de un bloque de lectura
+struct bloque_uring {
+    char * datos;
+    enum { B_LIBRE, B_LEYENDO, B_LISTO } estado;
+    long seq;           // orden del bloque en la entrada
+    int pedido;         // bytes pedidos a read
+    int len;            // bytes leídos
+    int procesado;      // bytes ya troceados
+    int refs;           // escrituras en vuelo que usan el bloque
+};
+
+// Estado de un fichero de salida
+struct trozo_uring {
+    int fd;
+    off_t escrito;      // bytes enviados a escribir
+    off_t completado;   // bytes cuya escritura ha acabado
+    off_t ventana;      // --sync=range: inicio de la primera ventana sin iniciar
+    int esperando;      // --sync=range: se espera a la ventana anterior
+    int pendientes;     // escrituras (y esperas a ventanas) en vuelo
+    int completo;       // no se le añadirán más datos
+    int cierre;         // se ha enviado su close
+};
+
+struct psplit_uring {
+    struct anillo a;
+    int l, b, s, fd, fijos;
+    char * name;
+    int regular;
+    off_t off_lectura, tam;
+    long seq_lectura, seq_proceso;
+    int leyendo;                // lecturas en vuelo
+    int eof;
+    struct bloque_uring bloques[URING_BUFFERS];
+    struct trozo_uring * trozos;
+    long n_trozos, cap_trozos;
+    long primer_abierto;        // primer trozo sin close enviado
+    long cerrados;
+    int saltos;                 // -l: saltos del trozo actual
+    long restante;              // -b: bytes que le faltan al trozo actual
+};
+
+struct peticion_uring * peticion(enum op_uring op, int buf, long trozo, int off, int len, off_t foff){
+    struct peticion_uring * pet;
+
+    if ((pet = malloc(sizeof(*pet))) == NULL){
+        perror("do_psplit: malloc");
+        exit(EXIT_FAILURE);
+    }
+    *pet = (struct peticion_uring) { op, buf, trozo, off, len, foff };
+    return pet;
+}
+
+void enviar_lectura(struct psplit_uring * u, int k, int off, int len, off_t foff){
+    struct bloque_uring * bl = &u->bloques[k];
+    struct io_uring_sqe * sqe;
+
+    sqe = anillo_sqe(&u->a, u->fijos ? IORING_OP_READ_FIXED : IORING_OP_READ, u->fd,
+                     peticion(OP_LEER, k, -1, off, len, foff));
+    sqe->addr = (__u64) (uintptr_t) (bl->datos + off);
+    sqe->len = len;
+    sqe->off = u->regular ? (__u64) foff : (__u64) -1;
+    sqe->buf_index = k;
+}
+
+void enviar_escritura(struct psplit_uring * u, int k, long t, int off, int len, off_t foff){
+    struct io_uring_sqe * sqe;
+
+    sqe = anillo_sqe(&u->a, u->fijos ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, u->trozos[t].fd,
+                     peticion(OP_ESCRIBIR, k, t, off, len, foff));
+    sqe->addr = (__u64) (uintptr_t) (u->bloques[k].datos + off);
+    sqe->len = len;
+    sqe->off = foff;
+    sqe->buf_index = k;
+}
+
+// Abre el siguiente fichero de salida
+void nuevo_trozo_uring(struct psplit_uring * u){
+    char nombre_fich [NAME_MAX+1];
+
+    if (u->n_trozos == u->cap_trozos) {
+        u->cap_trozos = u->cap_trozos ? 2 * u->cap_trozos : 64;
+        if ((u->trozos = realloc(u->trozos, u->cap_trozos * sizeof(*u->trozos))) == NULL){
+            perror("do_psplit: realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    u->trozos[u->n_trozos] = (struct trozo_uring) { abrir_trozo(u->name, u->n_trozos, nombre_fich), 0, 0, 0, 0, 0, 0, 0 };
+    u->n_trozos++;
+    u->saltos = 0;
+    u->restante = u->b;
+}
+
+// Trata una CQE
+void completar_uring(struct psplit_uring * u, struct peticion_uring * pet, int res){
+    struct bloque_uring * bl = pet->buf >= 0 ? &u->bloques[pet->buf] : NULL;
+
+    if (res < 0) {
+        errno = -res;
+        perror(pet->op == OP_LEER ? "do_psplit (read)" : pet->op == OP_ESCRIBIR ? "do_psplit (write)" :
+               pet->op == OP_SYNC ? "do_psplit (fsync)" : "do_psplit (close)");
+        exit(EXIT_FAILURE);
+    }
+
+    switch (pet->op) {
+        case OP_LEER:
+            bl->len += res;
+            if (res == 0) {
+                u->eof = 1;
+                bl->estado = B_LISTO;
+                u->leyendo--;
+            }
+            else if (u->regular && res < pet->len) {
+                // Lectura incompleta de un fichero regular: se pide el resto
+                enviar_lectura(u, pet->buf, pet->off + res, pet->len - res, pet->foff + res);
+            }
+            else {
+                bl->estado = B_LISTO;
+                u->leyendo--;
+            }
+            break;
+
+        case OP_ESCRIBIR:
+            u->trozos[pet->trozo].completado += res;
+            if (res < pet->len) {
+                enviar_escritura(u, pet->buf, pet->trozo, pet->off + res, pet->len - res, pet->foff + res);
+                break;
+            }
+            bl->refs--;
+            u->trozos[pet->trozo].pendientes--;
+            break;
+
+        case OP_SYNC:
+            if (pet->len) {
+                u->trozos[pet->trozo].esperando = 0;
+                u->trozos[pet->trozo].pendientes--;
+            }
+            break;
+
+        case OP_CERRAR:
+            u->cerrados++;
+            break;
+    }
+    free(pet);
+}
+
+// Envía todo lo que se pueda enviar sin esperar a ninguna CQE
+void avanzar_uring(struct psplit_uring * u){
+    struct bloque_uring * bl;
+    struct io_uring_sqe * sqe;
+    int k, n;
+
+    // --sync=range: inicia la escritura a disco de las ventanas ya escritas
+    for (long t = u->primer_abierto; g_psplit_sync == SYNC_RANGE && t < u->n_trozos; t++) {
+        struct trozo_uring * tr = &u->trozos[t];
+        while (!tr->esperando && tr->completado - tr->ventana >= VENTANA_SYNC_PSPLIT &&
+               anillo_libres(&u->a) >= 2) {
+            sqe = anillo_sqe(&u->a, IORING_OP_SYNC_FILE_RANGE, tr->fd, peticion(OP_SYNC, -1, t, 0, 0, 0));
+            sqe->off = tr->ventana;
+            sqe->len = VENTANA_SYNC_PSPLIT;
+            sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+            if (tr->ventana > 0) {
+                sqe = anillo_sqe(&u->a, IORING_OP_SYNC_FILE_RANGE, tr->fd,
+                                 peticion(OP_SYNC, -1, t, 0, VENTANA_SYNC_PSPLIT, 0));
+                sqe->off = tr->ventana - VENTANA_SYNC_PSPLIT;
+                sqe->len = VENTANA_SYNC_PSPLIT;
+                sqe->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                        SYNC_FILE_RANGE_WAIT_AFTER;
+                tr->esperando = 1;
+                tr->pendientes++;
+            }
+            tr->ventana += VENTANA_SYNC_PSPLIT;
+        }
+    }
+
+    // Cierra los ficheros completos sin escrituras pendientes
+    for (long t = u->primer_abierto; t < u->n_trozos && anillo_libres(&u->a) >= 2; t++) {
+        struct trozo_uring * tr = &u->trozos[t];
+        if (tr->cierre || !tr->completo || tr->pendientes)
+            continue;
+        if (g_psplit_sync == SYNC_ALWAYS || g_psplit_sync == SYNC_RANGE) {
+            sqe = anillo_sqe(&u->a, g_psplit_sync == SYNC_ALWAYS ? IORING_OP_FSYNC : IORING_OP_SYNC_FILE_RANGE,
+                             tr->fd, peticion(OP_SYNC, -1, t, 0, 0, 0));
+            if (g_psplit_sync == SYNC_RANGE) {
+                sqe->off = tr->ventana;     // las ventanas completas ya se han iniciado
+                sqe->sync_range_flags = SYNC_FILE_RANGE_WRITE;
+            }
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        anillo_sqe(&u->a, IORING_OP_CLOSE, tr->fd, peticion(OP_CERRAR, -1, t, 0, 0, 0));
+        tr->cierre = 1;
+    }
+    while (u->primer_abierto < u->n_trozos && u->trozos[u->primer_abierto].cierre)
+        u->primer_abierto++;
+
+    // Lecturas en los bloques libres
+    for (k = 0; k < URING_BUFFERS && !u->eof && anillo_libres(&u->a) > 0; k++) {
+        bl = &u->bloques[k];
+        if (bl->estado != B_LIBRE)
+            continue;
+        if (u->regular ? u->off_lectura >= u->tam : u->leyendo > 0)
+            break;
+        n = u->regular ? MIN((off_t) u->s, u->tam - u->off_lectura) : u->s;
+        *bl = (struct bloque_uring) { bl->datos, B_LEYENDO, u->seq_lectura++, n, 0, 0, 0 };
+        enviar_lectura(u, k, 0, n, u->off_lectura);
+        u->off_lectura += n;
+        u->leyendo++;
+    }
+    if (u->regular && u->off_lectura >= u->tam && !u->leyendo)
+        u->eof = 1;
+
+    // Trocea los bloques leídos, en orden
+    for (;;) {
+        for (k = 0; k < URING_BUFFERS && !(u->bloques[k].estado == B_LISTO &&
+                                           u->bloques[k].seq == u->seq_proceso); k++)
+            ;
+        if (k == URING_BUFFERS)
+            break;
+        bl = &u->bloques[k];
+
+        while (bl->procesado < bl->len && anillo_libres(&u->a) > 0) {
+            // Sólo se empieza un fichero nuevo si hay datos para él
+            if (u->l ? u->saltos == u->l : u->restante == 0) {
+                u->trozos[u->n_trozos - 1].completo = 1;
+                nuevo_trozo_uring(u);
+            }
+            // --sync=range: el fichero no crece hasta que acabe la espera a su ventana anterior
+            if (u->trozos[u->n_trozos - 1].esperando)
+                break;
+            if (u->l)
+                n = buscar_saltos(bl->datos + bl->procesado, bl->len - bl->procesado, u->l, &u->saltos);
+            else
+                n = MIN((long) (bl->len - bl->procesado), u->restante);
+            u->restante -= n;
+
+            struct trozo_uring * tr = &u->trozos[u->n_trozos - 1];
+            enviar_escritura(u, k, u->n_trozos - 1, bl->procesado, n, tr->escrito);
+            tr->escrito += n;
+            tr->pendientes++;
+            bl->refs++;
+            bl->procesado += n;
+        }
+        if (bl->procesado < bl->len || bl->refs > 0)
+            break;
+        bl->estado = B_LIBRE;
+        u->seq_proceso++;
+    }
+}
+
+// psplit con el motor io_uring. Devuelve 0 si no se puede usar io_uring y
+// hay que usar el motor síncrono. Necesita 'l > 0' o 'b > 0': cada bloque se
+// trocea según uno de los dos y con ambos a 0 no avanzaría.
+int do_psplit_uring(int l, int b, int s, int fd, char * name){
+    struct psplit_uring u;
+    struct iovec iov[URING_BUFFERS];
+    struct stat st;
+    struct io_uring_cqe * cqe;
+    unsigned cabeza;
+
+    if (l <= 0 && b <= 0)
+        return 0;
+    memset(&u, 0, sizeof(u));
+    if (fstat(fd, &st) == -1){
+        perror("do_psplit (fstat)");
+        exit(EXIT_FAILURE);
+    }
+    if (!anillo_iniciar(&u.a, URING_ENTRADAS)) {
+        DPRINTF(DBG_TRACE, "io_uring no disponible, se usa el motor síncrono\n");
+        return 0;
+    }
+
+    u.l = l; u.b = b; u.s = s; u.fd = fd; u.name = name;
+    u.regular = S_ISREG(st.st_mode);
+    if (u.regular) {
+        u.tam = st.st_size;
+        if ((u.off_lectura = lseek(fd, 0, SEEK_CUR)) == -1){
+            perror("do_psplit (lseek)");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int k = 0; k < URING_BUFFERS; k++) {
+        u.bloques[k].datos = reservar_bloque(s);
+        iov[k] = (struct iovec) { u.bloques[k].datos, s };
+    }
+    u.fijos = syscall(__NR_io_uring_register, u.a.fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+    DPRINTF(DBG_TRACE, "io_uring: %d bloques de %d bytes%s\n", URING_BUFFERS, s, u.fijos ? " registrados" : "");
+
+    nuevo_trozo_uring(&u);
+    for (;;) {
+        avanzar_uring(&u);
+
+        // La entrada se ha leído y troceada entera: el último fichero está completo
+        if (u.eof && !u.leyendo && !u.trozos[u.n_trozos - 1].completo) {
+            int k;
+            for (k = 0; k < URING_BUFFERS && u.bloques[k].estado == B_LIBRE; k++)
+                ;
+            if (k == URING_BUFFERS) {
+                u.trozos[u.n_trozos - 1].completo = 1;
+                continue;
+            }
+        }
+        if (u.cerrados == u.n_trozos && u.a.en_vuelo == 0)
+            break;
+
+        anillo_enviar(&u.a, 1);
+        cabeza = *u.a.cq_head;
+        while (cabeza != __atomic_load_n(u.a.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &u.a.cqes[cabeza++ & *u.a.cq_mask];
+            u.a.en_vuelo--;
+            completar_uring(&u, (struct peticion_uring *) (uintptr_t) cqe->user_data, cqe->res);
+        }
+        __atomic_store_n(u.a.cq_head, cabeza, __ATOMIC_RELEASE);
+    }
+
+    if (u.regular)
+        TRY ( lseek(fd, u.tam, SEEK_SET) );
+    for (int k = 0; k < URING_BUFFERS; k++)
+        free(u.bloques[k].datos);
+    free(u.trozos);
+    anillo_liberar(&u.a);
+    return 1;
+}
+
+// 's' es el tamaño de bloque de -s, o 0 para elegirlo según la entrada
+void do_psplit(int l, int b, int s, int fd, char * name){
+    if (!s)
+        s = tam_bloque_psplit(fd);
+    if (g_psplit_io == IO_URING && do_psplit_uring(l, b, s, fd, name))
+        return;
+    if (b) {
+        do_psplit_bytes(b, s, fd, name);
+        return;
+    }
+    if (do_psplit_lineas_mmap(l, fd, name))
+        return;
+
+    char * buffer = reservar_bloque(s);  // almacenará los datos leidos de fichero
+    char nombre_fich [NAME_MAX+1]; // + 1 porque no incluye el char \0 en la especificacion de NAME_MAX.
+
+    int offset, indice;
+    /*
+     * 'offsset' se utiliza para adelantar el buffer en caso de que ya se haya escrito una parte de los bytes leidos
+    */
+    offset = indice = 0;
+
+    // Primer fichero que se crea
+    int fd_i = abrir_trozo(name, indice, nombre_fich);
+
+    int i, saltos;  // variables que se usaran para la opcion -l
+    i = saltos = 0;
+    int bytesLeidos = 0;    // bytes que leemos con read()
+
+    while ((bytesLeidos = read(fd, buffer, s)) > 0) {
+        i = 0;
+        offset = 0;
+        while(i < bytesLeidos){
+            if(saltos == l){
+                cerrar_trozo(fd_i);
+                fd_i = abrir_trozo(name, ++indice, nombre_fich);
+                saltos = 0;
+            }
+
+            i += buscar_saltos(buffer + i, bytesLeidos - i, l, &saltos);
+
+            escribir_todo(fd_i, buffer + offset, i - offset);
+            offset = i;
+        }
+    }
+    if (bytesLeidos < 0){
+        perror("do_psplit (read)");
+        exit(EXIT_FAILURE);
+    }
+    cerrar_trozo(fd_i);
+    free(buffer);
+}
+
+/*
+ * psplit -p sobre un único fichero regular
+ *
+ * El fichero se reparte entre varios procesos en lugar de procesarlo uno solo:
+ *   1. (sólo -l) Cada proceso cuenta los saltos de línea de una parte del
+ *      fichero. Con la suma de prefijos de esas cuentas, el padre sabe cuántos
+ *      saltos hay antes de cada parte.
+ *   2. (sólo -l) Cada proceso busca en su parte los saltos que cierran un
+ *      trozo (los múltiplos de 'l') y anota dónde empieza el siguiente.
+ *   3. Los trozos se reparten entre los procesos, que copian cada uno a su
+ *      fichero de salida a partir de su desplazamiento en la entrada.
+ * Con -b los límites de los trozos se calculan directamente (fase 3).
+ * Los ficheros resultantes son los mismos que con do_psplit().
+ */
+
+// Tamaño mínimo de la parte de la entrada que se asigna a cada proceso
+#define MIN_PARTE_PSPLIT (64 << 10)
+
+// Datos compartidos por los procesos de una ejecución en paralelo de psplit
+struct psplit_par {
+    int fd;             // fichero de entrada
+    char * base;        // proyección en memoria de la entrada
+    off_t tam;          // tamaño de la entrada
+    int l;              // líneas por trozo (-l)
+    char * name;        // prefijo de los ficheros de salida
+    int partes;         // número de partes en que se divide la entrada (fases 1 y 2)
+    int procesos;       // número de procesos que escriben trozos (fase 3)
+    long * saltos;      // fase 1: saltos de cada parte; fase 2: saltos antes de cada parte
+    off_t * limites;    // inicio de cada trozo; limites[n_trozos] == tam
+    long n_trozos;
+};
+
+// Límites [ini, fin) de la parte 'w' de la entrada
+void parte_psplit(struct psplit_par * par, int w, off_t * ini, off_t * fin){
+    *ini = par->tam / par->partes * w;
+    *fin = (w == par->partes - 1) ? par->tam : par->tam / par->partes * (w + 1);
+}
+
+// Fase 1: cuenta los saltos de línea de la parte 'w'
+void contar_saltos_psplit(int w, void * datos){
+    struct psplit_par * par = datos;
+    off_t ini, fin;
+    long cuenta = 0;
+    int saltos;
+
+    parte_psplit(par, w, &ini, &fin);
+    while (ini < fin) {
+        saltos = 0;
+        ini += buscar_saltos(par->base + ini, fin - ini, INT_MAX, &saltos);
+        cuenta += saltos;
+    }
+    par->saltos[w] = cuenta;
+}
+
+// Fase 2: anota el inicio de los trozos que empiezan en la parte 'w'
+void buscar_limites_psplit(int w, void * datos){
+    struct psplit_par * par = datos;
+    off_t ini, fin;
+    long vistos = par->saltos[w];   // saltos de línea anteriores a 'ini'
+    int saltos, previos;
+
+    parte_psplit(par, w, &ini, &fin);
+    while (ini < fin) {
+        saltos = previos = vistos % par->l;
+        ini += buscar_saltos(par->base + ini, fin - ini, par->l, &saltos);
+        vistos += saltos - previos;
+        if (saltos == par->l)
+            par->limites[vistos / par->l] = ini;
+    }
+}
+
+// Fase 3: escribe los trozos 'w', 'w + procesos', 'w + 2 procesos'...
+void escribir_trozos_psplit(int w, void * datos){
+    struct psplit_par * par = datos;
+    char nombre_fich [NAME_MAX+1];
+    off_t off;
+    size_t n;
+    ssize_t copiados;
+    int fd_i;
+
+    for (long k = w; k < par->n_trozos; k += par->procesos) {
+        fd_i = abrir_trozo(par->name, k, nombre_fich);
+        off = par->limites[k];
+        n = par->limites[k+1] - off;
+        while (n > 0) {
+            do {
+                copiados = copy_file_range(par->fd, &off, fd_i, NULL, max_escritura(n), 0);
+            } while (copiados == -1 && errno == EINTR);
+            if (copiados == -1) {
+                if (errno != EINVAL && errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP){
+                    perror("do_psplit (copy_file_range)");
+                    exit(EXIT_FAILURE);
+                }
+                // Sin copia en el núcleo se escribe desde la proyección
+                escribir_todo(fd_i, par->base + off, n);
+                break;
+            }
+            volcar_ventanas(fd_i, copiados);
+            n -= copiados;
+        }
+        cerrar_trozo(fd_i);
+    }
+}
+
+// Planificador de procesos de psplit -p
+//
+// Ejecuta 'tarea(i, datos)' para i = 0..n-1, cada una en un proceso hijo, con
+// como mucho 'p' procesos a la vez. En cuanto termina cualquiera de ellos se
+// lanza la siguiente tarea, sin esperar a los que se lanzaron antes. Si se
+// cosecha un proceso en segundo plano mientras tanto, se notifica igual que
+// en el resto del shell. Si 'estados' no es NULL, deja en 'estados[i]' el
+// estado de salida de la tarea i.
+// Devuelve 0 si alguna tarea ha fallado.
+int planificar(int n, int p, void (*tarea)(int, void *), void * datos, int * estados){
+    struct {
+        pid_t pid;
+        int tarea;
+        struct timespec inicio;
+    } trab[p];
+    struct timespec fin;
+    int siguiente = 0, activos = 0, estado, ok = 1, w;
+    struct rusage ru;
+    pid_t pid;
+
+    for (w = 0; w < p; w++)
+        trab[w].pid = -1;
+
+    while (siguiente < n || activos > 0) {
+        // Ocupa los huecos libres con las siguientes tareas
+        for (w = 0; w < p && siguiente < n; w++) {
+            if (trab[w].pid != -1)
+                continue;
+            trab[w].tarea = siguiente++;
+            clock_gettime(CLOCK_MONOTONIC, &trab[w].inicio);
+            if ((trab[w].pid = fork_or_panic("fork psplit")) == 0) {
+                tarea(trab[w].tarea, datos);
+                exit(EXIT_SUCCESS);
+            }
+            activos++;
+        }
+
+        // Espera al primero que termine
+        if ((pid = wait4(-1, &estado, 0, &ru)) == -1){
+            perror("run_psplit (wait4)");
+            exit(EXIT_FAILURE);
+        }
+        for (w = 0; w < p && trab[w].pid != pid; w++)
+            ;
+        if (w == p) {
+            notificar_fin_2plano(pid, estado, &ru);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &fin);
+        DPRINTF(DBG_TRACE, "tarea %d: pid %d, hueco %d, %.6f s\n", trab[w].tarea, pid, w,
+                (fin.tv_sec - trab[w].inicio.tv_sec) + (fin.tv_nsec - trab[w].inicio.tv_nsec) / 1e9);
+        if (!WIFEXITED(estado) || WEXITSTATUS(estado) != EXIT_SUCCESS)
+            ok = 0;
+        if (estados != NULL)
+            estados[trab[w].tarea] = estado;
+        trab[w].pid = -1;
+        activos--;
+    }
+    return ok;
+}
+
+// Reserva memoria compartida con los procesos hijos
+void * mmap_compartida(size_t tam){
+    void * p;
+
+    if ((p = mmap(NULL, tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+        perror("run_psplit (mmap)");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Divide el fichero 'name' entre 'p' procesos. Devuelve 0 si el fichero no
+// es un fichero regular no vacío (o no se puede proyectar) y hay que usar
+// do_psplit() en su lugar. Sin -b hace falta 'l > 0': los límites de los
+// trozos se calculan dividiendo entre 'l'.
+int do_psplit_paralelo(int l, int b, int p, char * name){
+    struct psplit_par par = { .l = l, .name = name };
+    struct stat st;
+    long total = 0;
+    int ok = 1;
+
+    if (!b && l <= 0)
+        return 0;
+    if ((par.fd = open(name, O_RDONLY)) == -1){
+        perror("run_psplit (open)");
+        return 1;
+    }
+    if (fstat(par.fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        (par.base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, par.fd, 0)) == MAP_FAILED) {
+        TRY ( close(par.fd) );
+        return 0;
+    }
+    par.tam = st.st_size;
+
+    if (b) {
+        par.n_trozos = (par.tam + b - 1) / b;
+        par.limites = mmap_compartida((par.n_trozos + 1) * sizeof(off_t));
+        for (long k = 0; k < par.n_trozos; k++)
+            par.limites[k] = k * b;
+    }
+    else {
+        par.partes = MAX(1, MIN(p, par.tam / MIN_PARTE_PSPLIT));
+        par.saltos = mmap_compartida(par.partes * sizeof(long));
+
+        ok = planificar(par.partes, par.partes, contar_saltos_psplit, &par, NULL);
+
+        // Suma de prefijos: saltos[w] pasa a ser el número de saltos antes de la parte 'w'
+        for (int w = 0; ok && w < par.partes; w++) {
+            long cuenta = par.saltos[w];
+            par.saltos[w] = total;
+            total += cuenta;
+        }
+
+        if (ok) {
+            par.limites = mmap_compartida((total / l + 2) * sizeof(off_t));
+            par.limites[0] = 0;
+            ok = planificar(par.partes, par.partes, buscar_limites_psplit, &par, NULL);
+        }
+
+        // Si el último salto que cierra un trozo es el final del fichero, no
+        // hay un trozo vacío detrás (igual que en do_psplit())
+        par.n_trozos = total / l + 1;
+        if (ok && total / l >= 1 && par.limites[total / l] == par.tam)
+            par.n_trozos--;
+    }
+
+    if (ok) {
+        par.limites[par.n_trozos] = par.tam;
+        par.procesos = MIN(p, par.n_trozos);
+        ok = planificar(par.procesos, par.procesos, escribir_trozos_psplit, &par, NULL);
+    }
+    if (!ok)
+        fprintf(stderr, "psplit: Error al dividir '%s' en paralelo\n", name);
+
+    if (par.saltos)
+        TRY ( munmap(par.saltos, par.partes * sizeof(long)) );
+    if (par.limites)
+        TRY ( munmap(par.limites, (b ? par.n_trozos + 1 : total / l + 2) * sizeof(off_t)) );
+    TRY ( munmap(par.base, par.tam) );
+    TRY ( close(par.fd) );
+    return 1;
+}
+
+// Ficheros de entrada de psplit -p con varios ficheros
+struct fichero_psplit {
+    char * nombre;
+    off_t tam;
+};
+
+struct psplit_ficheros {
+    int l, b, s;
+    struct fichero_psplit * ficheros;
+};
+
+// Orden de mayor a menor tamaño para qsort()
+int comparar_ficheros_psplit(const void * a, const void * b){
+    off_t ta = ((const struct fichero_psplit *) a)->tam;
+    off_t tb = ((const struct fichero_psplit *) b)->tam;
+    return (ta < tb) - (ta > tb);
+}
+
+// Tarea del planificador: divide el fichero 'i'
+void psplit_fichero(int i, void * datos){
+    struct psplit_ficheros * pf = datos;
+    char * nombre = pf->ficheros[i].nombre;
+    int fd;
+
+    if ((fd = open(nombre, O_RDONLY, S_IRWXU)) == -1){
+        perror("run_psplit (open)");
+        exit(EXIT_FAILURE);
+    }
+    do_psplit(pf->l, pf->b, pf->s, fd, nombre);
+    TRY ( close(fd) );
+}
+
+void run_psplit(struct execcmd* ecmd)
+{
+    char errPsplit[] = {'s','p','l','b'};
+    static struct option opciones_largas[] = {
+        { "sync", required_argument, NULL, 'y' },
+        { "io", required_argument, NULL, 'u' },
+        { NULL, 0, NULL, 0 }
+    };
+	int opt, l, b, s, p, error, flag_b, flag_l;
+    enum sync_psplit sync = SYNC_ALWAYS;
+    enum io_psplit io = IO_SYNC;
+    l = b = error = flag_l = flag_b = 0;
+    s = 0;      // sin -s, do_psplit() elige el tamaño según la entrada
+    p = 1;
+    optind = 0;     // 0 reinicia también el estado interno de getopt (glibc)
+    while (!error && (opt = getopt_long(ecmd->argc, ecmd->argv, "l:b:s:p:h", opciones_largas, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                if(flag_b) error = 1;
+                else{
+                    l = atoi(optarg);
+                    if(l <= 0) error = 4;
+                    else
+                        flag_l = 1;
+                }
+                break;
+            case 'b':
+                if(flag_l) error = 1;
+                else{
+                    b = atoi(optarg);
+                    if(b <= 0) error = 5;
+                    else
+                        flag_b = 1;
+                }
+                break;
+            case 's':
+                s = atoi(optarg);
+                if(s <= 0 || s > MAX_BSIZE_PSPLIT) error = 2;
+                break;
+            case 'p':
+                p = atoi(optarg);
+                if(p <= 0) error = 3;
+                break;
+            case 'y':
+                sync = SYNC_ALWAYS;
+                while (sync <= SYNC_RANGE && strcmp(optarg, nombres_sync[sync]) != 0)
+                    sync++;
+                if (sync > SYNC_RANGE) error = 7;
+                break;
+            case 'u':
+                io = IO_SYNC;
+                while (io <= IO_URING && strcmp(optarg, nombres_io[io]) != 0)
+                    io++;
+                if (io > IO_URING) error = 8;
+                break;
+            case 'h':
+                printf("%s\n", help_psplit());
+                return;
+                break;
+            default:
+                fprintf(stderr, "Uso: psplit [-l NLINES] [-b NBYTES] [-s BSIZE] [-p PROCS] [FILE1] [FILE2]...\n");
+        }
+    }
+    // Sin -l ni -b no hay tamaño de trozo y el troceo no avanzaría
+    if (!error && !flag_l && !flag_b)
+        error = 6;
+    switch(error){
+        case 1:
+            fprintf(stderr, "psplit: Opciones incompatibles\n");
+            break;
+        case 2:
+        case 3:
+        case 4:
+        case 5:
+            fprintf(stderr, "psplit: Opción -%c no válida\n", errPsplit[error-2]);
+            break;
+        case 6:
+            fprintf(stderr, "psplit: Falta la opción -l o -b\n");
+            break;
+        case 7:
+            fprintf(stderr, "psplit: Opción --sync no válida\n");
+            break;
+        case 8:
+            fprintf(stderr, "psplit: Opción --io no válida\n");
+            break;
+    }
+    if(!error){
+        g_psplit_sync = sync;
+        g_psplit_io = io;
+
+        if(optind == ecmd->argc){   // No mas argumentos que leer => lectura de la entrada estándar
+            char * file_in = "stdin";
+            do_psplit(l, b, s, STDIN_FILENO, file_in);
+        }
+        else if (p > 1 && optind == ecmd->argc - 1 && do_psplit_paralelo(l, b, p, ecmd->argv[optind])) {
+            // Un único fichero con -p: se divide el propio fichero entre los procesos
+        }
+        else {  // Procesamiento de los ficheros en paralelo según la opción -p
+            int n = ecmd->argc - optind;
+            struct fichero_psplit ficheros[n];
+            struct psplit_ficheros pf = { l, b, s, ficheros };
+
+            // Los ficheros más grandes se lanzan primero para que no quede
+            // uno grande al final con el resto de procesos ya libres
+            for (int i = 0; i < n; i++) {
+                struct stat st;
+                ficheros[i].nombre = ecmd->argv[optind + i];
+                ficheros[i].tam = stat(ficheros[i].nombre, &st) == -1 ? 0 : st.st_size;
+            }
+            qsort(ficheros, n, sizeof(*ficheros), comparar_ficheros_psplit);
+
+            planificar(n, p, psplit_fichero, &pf, NULL);
+        }
+
+        if (g_psplit_sync == SYNC_END) {
+            char * file_in = "stdin";
+            if (optind == ecmd->argc)
+                sincronizar_psplit(&file_in, 1);
+            else
+                sincronizar_psplit(ecmd->argv + optind, ecmd->argc - optind);
+        }
+    }
+}
+
+// Tabla de los procesos que se están ejecutando en segundo plano. Los trabajos
+// se guardan en un vector denso (que es lo que recorre `bjobs`) y un índice
+// hash con direccionamiento abierto asocia cada PID con su posición en el
+// vector, de modo que guardar, buscar y eliminar un PID cuestan O(1).
+//
+// Los hijos se cosechan de forma síncrona (ver `cosechar_pendientes`), así que
+// la tabla sólo se modifica desde el bucle principal y no necesita proteger
+// sus operaciones bloqueando SIGCHLD.
+
+#define MIN_TRABAJOS 16
+
+struct trabajo {
+    pid_t pid;
+    struct timespec inicio;     // CLOCK_MONOTONIC al lanzarlo
+    int en_cola;                // Esperando un hueco libre
+    int heredado;               // Lo lanzó el padre de este proceso (ver `olvidar_cola`)
+};
+
+struct tabla_trabajos {
+    struct trabajo* trabajos;   // Vector denso con los 'n' trabajos
+    int n;
+    int n_cola;                 // Cuántos de ellos esperan un hueco
+    int n_heredados;            // Cuántos heredados no esperan hueco
+    int cap;
+    int* indice;        // Posición en 'trabajos' + 1, o 0 si está libre
+    unsigned mascara;   // Tamaño del índice (2 * cap, potencia de 2) - 1
+};
+
+struct tabla_trabajos g_trabajos = { NULL, 0, 0, 0, 0, NULL, 0 };
+
+unsigned hash_pid(pid_t pid)
+{
+    unsigned h = (unsigned) pid * 2654435761u;
+    return (h ^ (h >> 16)) & g_trabajos.mascara;
+}
+
+// Entrada del índice que contiene a 'pid', o la entrada libre donde iría
+unsigned buscar_entrada(pid_t pid)
+{
+    unsigned i = hash_pid(pid);
+
+    while (g_trabajos.indice[i] != 0 && g_trabajos.trabajos[g_trabajos.indice[i] - 1].pid != pid)
+        i = (i + 1) & g_trabajos.mascara;
+    return i;
+}
+
+// Duplica la capacidad de la tabla y reconstruye el índice
+void crecer_trabajos()
+{
+    int cap = MAX(2 * g_trabajos.cap, MIN_TRABAJOS);
+    struct trabajo* trabajos;
+    int* indice;
+
+    if ((trabajos = realloc(g_trabajos.trabajos, cap * sizeof(struct trabajo))) == NULL ||
+        (indice = calloc(2 * cap, sizeof(int))) == NULL)
+    {
+        perror("crecer_trabajos: malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    free(g_trabajos.indice);
+    g_trabajos.trabajos = trabajos;
+    g_trabajos.indice = indice;
+    g_trabajos.cap = cap;
+    g_trabajos.mascara = 2 * cap - 1;
+    for (int i = 0; i < g_trabajos.n; i++)
+        g_trabajos.indice[buscar_entrada(g_trabajos.trabajos[i].pid)] = i + 1;
+}
+
+// Guarda 'pid' en la tabla (en espera de un hueco si 'en_cola')
+void guardar_pid(pid_t pid, int en_cola)
+{
+    if (g_trabajos.n == g_trabajos.cap)
+        crecer_trabajos();
+
+    g_trabajos.trabajos[g_trabajos.n].pid = pid;
+    clock_gettime(CLOCK_MONOTONIC, &g_trabajos.trabajos[g_trabajos.n].inicio);
+    g_trabajos.trabajos[g_trabajos.n].en_cola = en_cola;
+    g_trabajos.trabajos[g_trabajos.n].heredado = 0;
+    g_trabajos.n++;
+    g_trabajos.n_cola += en_cola;
+    if (en_cola)
+        encolar_pid(pid);
+    g_trabajos.indice[buscar_entrada(pid)] = g_trabajos.n;
+}
+
+// Elimina 'pid' de la tabla y, si 'trabajo' no es NULL, lo copia ahí.
+// Devuelve 0 si no estaba.
+int eliminar_pid(pid_t pid, struct trabajo* trabajo)
+{
+    unsigned i, j, k;
+    int pos, ultimo;
+
+    if (g_trabajos.n == 0 || g_trabajos.indice[i = buscar_entrada(pid)] == 0)
+        return 0;
+
+    // El último PID del vector denso ocupa el hueco que deja 'pid'
+    pos = g_trabajos.indice[i] - 1;
+    if (trabajo != NULL)
+        *trabajo = g_trabajos.trabajos[pos];
+    g_trabajos.n_cola -= g_trabajos.trabajos[pos].en_cola;
+    g_trabajos.n_heredados -= g_trabajos.trabajos[pos].heredado && !g_trabajos.trabajos[pos].en_cola;
+    ultimo = --g_trabajos.n;
+    if (pos != ultimo) {
+        g_trabajos.trabajos[pos] = g_trabajos.trabajos[ultimo];
+        g_trabajos.indice[buscar_entrada(g_trabajos.trabajos[pos].pid)] = pos + 1;
+    }
+
+    // Borrado con desplazamiento hacia atrás: se adelantan las entradas
+    // siguientes que no quedarían alcanzables desde su posición ideal
+    for (j = i; ; ) {
+        j = (j + 1) & g_trabajos.mascara;
+        if (g_trabajos.indice[j] == 0)
+            break;
+        k = hash_pid(g_trabajos.trabajos[g_trabajos.indice[j] - 1].pid);
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            g_trabajos.indice[i] = g_trabajos.indice[j];
+            i = j;
+        }
+    }
+    g_trabajos.indice[i] = 0;
+
+    return 1;
+}
+
+// Huecos para trabajos en segundo plano (`bjobs -s`): como mucho 'g_huecos'
+// se ejecutan a la vez. Por defecto hay uno por CPU en línea.
+//
+// Un trabajo que no encuentra hueco se lanza igualmente con fork(), pero el
+// hijo se queda parado en sigwaitinfo() hasta que el shell le envía SIGUSR1
+// (`lanzar_encolados`). Así el árbol `cmd` del trabajo, que vive en la caché
+// de planes, no tiene que sobrevivir a la línea, y el PID existe desde el
+// principio para `bjobs`, `bjobs -k` o kill. Los PIDs en espera se guardan
+// en una cola FIFO; los que terminan antes de salir de ella (por ejemplo, con
+// `bjobs -k`) se descartan al llegar a la cabeza.
+int g_huecos = 1;
+
+struct cola_trabajos {
+    pid_t* pids;
+    int ini;
+    int fin;
+    int cap;
+};
+
+struct cola_trabajos g_cola = { NULL, 0, 0, 0 };
+
+// Trabajo de la tabla con ese 'pid', o NULL si no está
+struct trabajo* buscar_trabajo(pid_t pid)
+{
+    unsigned i;
+
+    if (g_trabajos.n == 0 || g_trabajos.indice[i = buscar_entrada(pid)] == 0)
+        return NULL;
+    return &g_trabajos.trabajos[g_trabajos.indice[i] - 1];
+}
+
+void encolar_pid(pid_t pid)
+{
+    if (g_cola.fin == g_cola.cap) {
+        if (g_cola.ini > 0) {
+            memmove(g_cola.pids, g_cola.pids + g_cola.ini, (g_cola.fin - g_cola.ini) * sizeof(pid_t));
+            g_cola.fin -= g_cola.ini;
+            g_cola.ini = 0;
+        } else {
+            g_cola.cap = MAX(2 * g_cola.cap, MIN_TRABAJOS);
+            if ((g_cola.pids = realloc(g_cola.pids, g_cola.cap * sizeof(pid_t))) == NULL) {
+                perror("encolar_pid: realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    g_cola.pids[g_cola.fin++] = pid;
+}
+
+// Saca de la cola el primer trabajo que sigue esperando, o devuelve NULL
+struct trabajo* desencolar_trabajo()
+{
+    struct trabajo* t;
+
+    while (g_cola.ini < g_cola.fin) {
+        t = buscar_trabajo(g_cola.pids[g_cola.ini++]);
+        if (t != NULL && t->en_cola)
+            return t;
+    }
+    g_cola.ini = g_cola.fin = 0;
+    return NULL;
+}
+
+// Los trabajos heredados no ocupan huecos: este proceso no los cosecha
+int hay_hueco()
+{
+    return g_trabajos.n - g_trabajos.n_cola - g_trabajos.n_heredados < g_huecos;
+}
+
+// Trabajos lanzados por este proceso que esperan hueco
+int propios_en_cola()
+{
+    int n = 0;
+
+    for (int i = 0; i < g_trabajos.n; i++)
+        n += g_trabajos.trabajos[i].en_cola && !g_trabajos.trabajos[i].heredado;
+    return n;
+}
+
+// Pone en marcha los trabajos en espera mientras haya huecos libres
+void lanzar_encolados()
+{
+    struct trabajo* t;
+
+    while (hay_hueco() && (t = desencolar_trabajo()) != NULL) {
+        t->en_cola = 0;
+        g_trabajos.n_cola--;
+        clock_gettime(CLOCK_MONOTONIC, &t->inicio);
+        if (kill(t->pid, SIGUSR1) == -1 && errno != ESRCH) {
+            perror("kill");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Planificador de la cola tras salir del shell. 'pidfds' tiene los pidfds de
+// los 'n_ejec' trabajos en ejecución seguidos de los de la cola, en orden.
+// Cada vez que termina un trabajo pone en marcha el siguiente de la cola.
+void planificar_cola(int* pidfds, int n_ejec, int n)
+{
+    struct pollfd pfd[n];
+    int activos = n_ejec, sig = n_ejec, i;
+
+    for (i = 0; i < n; i++) {
+        pfd[i].fd = i < n_ejec ? pidfds[i] : -1;
+        pfd[i].events = POLLIN;
+    }
+    for (;;) {
+        // Un trabajo que ya no existe (p.ej. muerto con kill mientras estaba
+        // en cola) libera su hueco en cuanto se llama a poll()
+        for (; activos < g_huecos && sig < n; sig++, activos++) {
+            if (syscall(__NR_pidfd_send_signal, pidfds[sig], SIGUSR1, NULL, 0) == -1 && errno != ESRCH) {
+                perror("pidfd_send_signal");
+                _exit(EXIT_FAILURE);
+            }
+            pfd[sig].fd = pidfds[sig];
+        }
+        if (sig == n)
+            break;
+        if (poll(pfd, n, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            _exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; i++)
+            if (pfd[i].fd != -1 && pfd[i].revents) {
+                close(pfd[i].fd);
+                pfd[i].fd = -1;
+                activos--;
+            }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+// Al salir del shell (con atexit()) los trabajos en espera siguen respetando
+// los huecos. Como ya no habrá shell que los cosechen, se encarga un proceso
+// desligado de él (`planificar_cola`) que los vigila con pidfds. Si no hay
+// pidfds (núcleo anterior a 5.3) o no se puede crear el proceso, el shell
+// vacía la cola antes de salir. Los hijos del shell heredan el manejador, pero
+// sólo actúa sobre los trabajos que cada proceso ha dejado en su propia cola.
+void vaciar_cola()
+{
+    int pidfds[g_trabajos.n + 1], n = 0, n_ejec, i, estado, nulo;
+    struct trabajo* t;
+    struct rusage ru;
+    pid_t pid;
+
+    if (propios_en_cola() == 0)
+        return;
+
+    for (i = 0; i < g_trabajos.n; i++)
+        if (!g_trabajos.trabajos[i].en_cola && !g_trabajos.trabajos[i].heredado &&
+            (pidfds[n++] = syscall(__NR_pidfd_open, g_trabajos.trabajos[i].pid, 0)) == -1)
+            break;
+    n_ejec = n;
+    for (i = g_cola.ini; i < g_cola.fin && (n == 0 || pidfds[n - 1] != -1); i++)
+        if ((t = buscar_trabajo(g_cola.pids[i])) != NULL && t->en_cola)
+            pidfds[n++] = syscall(__NR_pidfd_open, t->pid, 0);
+
+    if (n == 0 || pidfds[n - 1] != -1) {
+        if ((pid = fork()) == 0) {
+            setsid();
+            if ((nulo = open("/dev/null", O_RDWR)) != -1) {
+                dup2(nulo, STDIN_FILENO);
+                dup2(nulo, STDOUT_FILENO);
+                dup2(nulo, STDERR_FILENO);
+            }
+            planificar_cola(pidfds, n_ejec, n);
+        }
+        if (pid == -1)
+            perror("fork");
+    }
+    else
+        pid = -1;
+    for (i = 0; i < n; i++)
+        if (pidfds[i] != -1)
+            TRY( close(pidfds[i]) );
+    if (pid != -1)
+        return;
+
+    // Sin planificador: el shell espera a que se liberen huecos
+    while (propios_en_cola() > 0) {
+        if ((pid = wait4(-1, &estado, 0, &ru)) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        notificar_fin_2plano(pid, estado, &ru);
+    }
+}
+
+// Un hijo del shell conserva la tabla de trabajos (para `bjobs | ...`), pero
+// no la cola: los trabajos en espera los pone en marcha el shell que los lanzó.
+// Los trabajos de la tabla pasan a ser heredados y no ocupan los huecos del
+// hijo, que no puede cosecharlos ni, por tanto, liberar su hueco.
+void olvidar_cola()
+{
+    g_cola.ini = g_cola.fin = 0;
+    g_trabajos.n_heredados = 0;
+    for (int i = 0; i < g_trabajos.n; i++) {
+        g_trabajos.trabajos[i].heredado = 1;
+        g_trabajos.n_heredados += !g_trabajos.trabajos[i].en_cola;
+    }
+}
+
+// Lanza 'cmd' en segundo plano sin hueco: el hijo espera la señal SIGUSR1
+pid_t lanzar_en_espera(struct cmd* cmd)
+{
+    sigset_t usr1, anterior;
+    pid_t pid;
+
+    // SIGUSR1 se bloquea antes de fork() para que no se pierda si el shell
+    // la envía antes de que el hijo llegue a sigwaitinfo()
+    if (sigemptyset(&usr1) == -1 || sigaddset(&usr1, SIGUSR1) == -1) {
+        perror("sigemptyset");
+        exit(EXIT_FAILURE);
+    }
+    if (sigprocmask(SIG_BLOCK, &usr1, &anterior) == -1) {
+        perror("sigprocmask (block SIGUSR1)");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((pid = fork_or_panic("fork BACK")) == 0) {
+        while (sigwaitinfo(&usr1, NULL) == -1)
+            if (errno != EINTR) {
+                perror("sigwaitinfo");
+                exit(EXIT_FAILURE);
+            }
+        if (sigprocmask(SIG_SETMASK, &anterior, NULL) == -1) {
+            perror("sigprocmask (SIGUSR1)");
+            exit(EXIT_FAILURE);
+        }
+        run_cmd_final(cmd);
+    }
+
+    if (sigprocmask(SIG_SETMASK, &anterior, NULL) == -1) {
+        perror("sigprocmask (SIGUSR1)");
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+// muestra todos los PIDs de la tabla de procesos en segundo plano (primero
+// los que se ejecutan y después los que esperan un hueco)
+void listar_pids()
+{
+    for (int i = 0; i < g_trabajos.n; ++i)
+        if (!g_trabajos.trabajos[i].en_cola)
+            printf("[%d]\n", g_trabajos.trabajos[i].pid);
+    for (int i = 0; i < g_trabajos.n; ++i)
+        if (g_trabajos.trabajos[i].en_cola)
+            printf("[%d]\n", g_trabajos.trabajos[i].pid);
+}
+
+// envia la señal SIGKILL a todos los procesos en segundo plano
+void matarTodos_pids()
+{
+    for (int i = 0; i < g_trabajos.n; ++i)
+        if (kill(g_trabajos.trabajos[i].pid, SIGKILL) == -1){
+            perror("kill");
+            exit(EXIT_FAILURE);
+        }
+}
+
+// Consumo de recursos de un trabajo: el de los que terminan sale de wait4(); el
+// de los que siguen en ejecución se lee de /proc/PID (-1 si no se puede).
+// Los bloques son de 512 bytes, como 'ru_inblock'/'ru_oublock'.
+struct uso_trabajo {
+    double real;
+    double user;
+    double sys;
+    long maxrss;        // KB
+    long inblock;
+    long oublock;
+};
+
+// Anillo con los últimos trabajos terminados, para `bjobs -v`
+#define MAX_TERMINADOS 32
+
+struct trabajo_terminado {
+    pid_t pid;
+    int estado;         // Tal y como lo devuelve wait4()
+    struct uso_trabajo uso;
+};
+
+struct trabajo_terminado g_terminados[MAX_TERMINADOS];
+unsigned long g_n_terminados = 0;  // Total de terminados (el anillo guarda los últimos)
+
+// Anota en el anillo el trabajo 't', que ha terminado con 'estado' y 'ru'
+void registrar_terminado(struct trabajo* t, int estado, struct rusage* ru)
+{
+    struct trabajo_terminado* tt = &g_terminados[g_n_terminados++ % MAX_TERMINADOS];
+
+    tt->pid = t->pid;
+    tt->estado = estado;
+    tt->uso.real = segundos_desde(&t->inicio);
+    tt->uso.user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    tt->uso.sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    tt->uso.maxrss = ru->ru_maxrss;
+    tt->uso.inblock = ru->ru_inblock;
+    tt->uso.oublock = ru->ru_oublock;
+}
+
+// Consumo hasta ahora del trabajo 't', que sigue en ejecución
+void leer_uso_en_curso(struct trabajo* t, struct uso_trabajo* uso)
+{
+    char ruta[64], *linea = NULL, *p;
+    size_t tam = 0;
+    unsigned long utime, stime;
+    long long valor;
+    FILE* f;
+
+    uso->real = segundos_desde(&t->inicio);
+    uso->user = uso->sys = -1;
+    uso->maxrss = uso->inblock = uso->oublock = -1;
+
+    // Campos 14 y 15 de /proc/PID/stat; el nombre (campo 2) puede tener espacios
+    snprintf(ruta, sizeof(ruta), "/proc/%d/stat", t->pid);
+    if ((f = fopen(ruta, "re")) != NULL) {
+        if (getline(&linea, &tam, f) != -1 && (p = strrchr(linea, ')')) != NULL &&
+            sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime) == 2)
+        {
+            uso->user = (double) utime / sysconf(_SC_CLK_TCK);
+            uso->sys = (double) stime / sysconf(_SC_CLK_TCK);
+        }
+        fclose(f);
+    }
+
+    snprintf(ruta, sizeof(ruta), "/proc/%d/status", t->pid);
+    if ((f = fopen(ruta, "re")) != NULL) {
+        while (getline(&linea, &tam, f) != -1)
+            if (sscanf(linea, "VmHWM: %lld", &valor) == 1)
+                uso->maxrss = valor;
+        fclose(f);
+    }
+
+    snprintf(ruta, sizeof(ruta), "/proc/%d/io", t->pid);
+    if ((f = fopen(ruta, "re")) != NULL) {
+        while (getline(&linea, &tam, f) != -1)
+            if (sscanf(linea, "read_bytes: %lld", &valor) == 1)
+                uso->inblock = valor / 512;
+            else if (sscanf(linea, "write_bytes: %lld", &valor) == 1)
+                uso->oublock = valor / 512;
+        fclose(f);
+    }
+
+    free(linea);
+}
+
+void imprimir_uso(pid_t pid, const char* estado, struct uso_trabajo* uso)
+{
+    printf("%-8d %-12s %9.3f", pid, estado, uso->real);
+    if (uso->user < 0)
+        printf(" %9s %9s", "-", "-");
+    else
+        printf(" %9.3f %9.3f", uso->user, uso->sys);
+    if (uso->maxrss < 0)
+        printf(" %10s", "-");
+    else
+        printf(" %10ld", uso->maxrss);
+    if (uso->inblock < 0)
+        printf(" %9s %9s\n", "-", "-");
+    else
+        printf(" %9ld %9ld\n", uso->inblock, uso->oublock);
+}
+
+// muestra el consumo de los trabajos en ejecución y de los últimos terminados
+void listar_pids_detalle()
+{
+    struct uso_trabajo uso;
+    struct trabajo_terminado* tt;
+    char estado[32];
+    unsigned long i;
+
+    printf("huecos: %d, en ejecución: %d, en cola: %d\n", g_huecos,
+           g_trabajos.n - g_trabajos.n_cola, g_trabajos.n_cola);
+    printf("%-8s %-12s %9s %9s %9s %10s %9s %9s\n", "PID", "ESTADO", "REAL(s)",
+           "USER(s)", "SYS(s)", "MAXRSS(KB)", "BLQ_ENT", "BLQ_SAL");
+
+    for (int j = 0; j < g_trabajos.n; ++j) {
+        leer_uso_en_curso(&g_trabajos.trabajos[j], &uso);
+        imprimir_uso(g_trabajos.trabajos[j].pid,
+                     g_trabajos.trabajos[j].en_cola ? "en cola" : "ejecutando", &uso);
+    }
+
+    i = (g_n_terminados > MAX_TERMINADOS) ? g_n_terminados - MAX_TERMINADOS : 0;
+    for (; i < g_n_terminados; i++) {
+        tt = &g_terminados[i % MAX_TERMINADOS];
+        if (WIFSIGNALED(tt->estado))
+            snprintf(estado, sizeof(estado), "señal %d", WTERMSIG(tt->estado));
+        else
+            snprintf(estado, sizeof(estado), "salida %d", WEXITSTATUS(tt->estado));
+        imprimir_uso(tt->pid, estado, &tt->uso);
+    }
+}
+
+/******************************************************************************
+ * Cosecha de procesos hijos
+ *
+ * SIGCHLD está siempre bloqueada en el shell y llega por el descriptor
+ * 'g_sigchld_fd' (signalfd), así que no hay manejador de señal: los hijos se
+ * cosechan de forma síncrona en `esperar_hijos` (mientras se espera a un
+ * comando) y en `cosechar_pendientes` (antes de leer cada orden y cuando
+ * SIGCHLD llega mientras `get_cmd` espera a que el usuario escriba).
+ ******************************************************************************/
+
+int g_sigchld_fd = -1;
+
+// Muestra '[pid]' si 'pid' era un proceso en segundo plano, lo elimina de la
+// tabla de trabajos, anota su estado y consumo en el anillo de terminados y
+// da su hueco al siguiente trabajo en espera
+void notificar_fin_2plano(pid_t pid, int estado, struct rusage* ru)
+{
+    struct trabajo t;
+
+    if (eliminar_pid(pid, &t)) {
+        registrar_terminado(&t, estado, ru);
+        printf("[%d]\n", pid);
+        fflush(stdout);
+        lanzar_encolados();
+    }
+}
+
+// Bloquea SIGCHLD para siempre y crea 'g_sigchld_fd'
+void iniciar_sigchld()
+{
+    sigset_t sigchld;
+    if (sigemptyset(&sigchld) == -1 || sigaddset(&sigchld, SIGCHLD) == -1) {
+        perror("sigemptyset");
+        exit(EXIT_FAILURE);
+    }
+    if (sigprocmask(SIG_BLOCK, &sigchld, NULL) == -1) {
+        perror("sigprocmask (block SIGCHLD)");
+        exit(EXIT_FAILURE);
+    }
+    if ((g_sigchld_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Desbloquea SIGCHLD (sólo en un hijo justo antes de execvp)
+void unblock_sigchld()
+{
+    sigset_t sigchld;
+    if (sigemptyset(&sigchld) == -1 || sigaddset(&sigchld, SIGCHLD) == -1) {
+        perror("sigemptyset");
+        exit(EXIT_FAILURE);
+    }
+    if (sigprocmask(SIG_UNBLOCK, &sigchld, NULL) == -1) {
+        perror("sigprocmask (unblock SIGCHLD)");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Cosecha sin esperar los hijos que ya han terminado y los notifica
+void cosechar_pendientes()
+{
+    struct signalfd_siginfo info[16];
+    struct rusage ru;
+    int estado;
+    pid_t pid;
+
+    // Varias SIGCHLD se funden en una: basta con vaciar el descriptor y
+    // preguntar a wait4 hasta que no quede nadie
+    while (read(g_sigchld_fd, info, sizeof(info)) > 0)
+        ;
+    while ((pid = wait4(-1, &estado, WNOHANG, &ru)) > 0)
+        notificar_fin_2plano(pid, estado, &ru);
+}
+
+// Espera a que terminen los 'n' hijos de 'pids' (los negativos se ignoran) y
+// deja su estado en 'estados' (si no es NULL). Los procesos en segundo plano
+// que terminen entretanto se cosechan y se notifican.
+void esperar_hijos(pid_t* pids, int n, int* estados)
+{
+    int quedan = 0, estado, i;
+    struct rusage ru;
+    pid_t pid;
+
+    for (i = 0; i < n; i++)
+        if (pids[i] > 0)
+            quedan++;
+
+    while (quedan > 0) {
+        if ((pid = wait4(-1, &estado, 0, &ru)) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("wait4");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n && pids[i] != pid; i++)
+            ;
+        if (i == n) {
+            notificar_fin_2plano(pid, estado, &ru);
+            continue;
+        }
+        if (estados != NULL)
+            estados[i] = estado;
+        quedan--;
+    }
+}
+
+void esperar_pid(pid_t pid)
+{
+    esperar_hijos(&pid, 1, NULL);
+}
+
+
+char * help_bjobs()
+{
+    return "Uso : bjobs [ - k ] [ - v ] [ - s HUECOS ] [ - h ]\n\tOpciones :\n\t-k Mata todos los procesos en segundo plano.\n\t-v Muestra el consumo de los procesos en segundo plano y de los últimos terminados.\n\t-s HUECOS Número máximo de procesos en segundo plano en ejecución a la vez (por defecto, uno por CPU).\n\t-h Ayuda\n";
+}
+
+void run_bjobs(struct execcmd* ecmd)
+{
+    int opt, error, flag_k, flag_v, huecos;
+    opt = error = flag_k = flag_v = huecos = 0;
+
+    optind = 0;     // 0 reinicia también el estado interno de getopt (glibc)
+    while (!error && (opt = getopt(ecmd->argc, ecmd->argv, "kvs:h")) != -1) {
+        switch (opt) {
+            case 'k':
+                flag_k = 1;
+                break;
+            case 'v':
+                flag_v = 1;
+                break;
+            case 's':
+                if ((huecos = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "bjobs: Opción -s no válida\n");
+                    error = 1;
+                }
+                break;
+            case 'h':
+                printf("%s\n", help_bjobs());
+                return;
+                break;
+            default:
+                error = 1;
+        }
+    }
+
+    if (!error){
+        if (huecos > 0) {
+            g_huecos = huecos;
+            lanzar_encolados();
+        }
+        if (flag_k)
+            matarTodos_pids();
+        else if (flag_v)
+            listar_pids_detalle();
+        else if (huecos == 0)
+            listar_pids();
+    }
+}
+
+/******************************************************************************
+ * Comando interno `wait`
+ ******************************************************************************/
+
+
+// `wait` espera a que terminen los trabajos en segundo plano indicados (o
+// todos, sin argumentos); con `-n`, sólo al primero de ellos. Por cada
+// trabajo que termina muestra su estado de salida, que se toma del anillo de
+// terminados de `bjobs -v`.
+//
+// La espera se hace con poll() sobre 'g_sigchld_fd' y un pidfd por trabajo,
+// sin sondeos. Cada vez que llega SIGCHLD se cosecha con `cosechar_pendientes`
+// como en el resto del shell, así que no se pierde ningún estado y los
+// trabajos en cola siguen arrancando cuando quedan huecos. El pidfd permite
+// además esperar a trabajos que no son hijos de este proceso (`wait` en una
+// tubería o en un subshell), aunque de ellos no se conoce el estado.
+
+char * help_wait()
+{
+    return "Uso: wait [-n] [-h] [PID]...\n\tOpciones:\n\tPID Espera a que termine el trabajo en segundo plano PID (por defecto, a todos).\n\t-n Espera sólo a que termine el primero de ellos.\n\t-h Ayuda\n";
+}
+
+// Estado del trabajo terminado 'pid' más reciente del anillo, o NULL
+struct trabajo_terminado* buscar_terminado(pid_t pid)
+{
+    unsigned long i, fin;
+
+    fin = (g_n_terminados > MAX_TERMINADOS) ? g_n_terminados - MAX_TERMINADOS : 0;
+    for (i = g_n_terminados; i > fin; i--)
+        if (g_terminados[(i - 1) % MAX_TERMINADOS].pid == pid)
+            return &g_terminados[(i - 1) % MAX_TERMINADOS];
+    return NULL;
+}
+
+void mostrar_estado(pid_t pid)
+{
+    struct trabajo_terminado* tt = buscar_terminado(pid);
+
+    if (tt == NULL)
+        printf("%d: terminado\n", pid);
+    else if (WIFSIGNALED(tt->estado))
+        printf("%d: señal %d\n", pid, WTERMSIG(tt->estado));
+    else
+        printf("%d: salida %d\n", pid, WEXITSTATUS(tt->estado));
+}
+
+// Espera a los 'n' trabajos de 'pids' (a uno solo si 'uno'). Los que terminan
+// se marcan con -1 y se muestra su estado.
+void esperar_trabajos(pid_t* pids, int n, int uno)
+{
+    struct pollfd pfd[n + 1];
+    int pidfd[n];
+    int quedan = n, terminados = 0, i;
+    siginfo_t info;
+
+    pfd[0].fd = g_sigchld_fd;
+    pfd[0].events = POLLIN;
+    for (i = 0; i < n; i++) {
+        pfd[i + 1].fd = pidfd[i] = syscall(__NR_pidfd_open, pids[i], 0);
+        pfd[i + 1].events = POLLIN;
+        // Sin pidfd (núcleo anterior a 5.3) sólo queda SIGCHLD, que no llega
+        // si el trabajo no es hijo nuestro (p.ej. la tabla heredada en un
+        // hijo del shell): poll() no se despertaría nunca por él
+        if (pidfd[i] == -1 && waitid(P_PID, pids[i], &info, WEXITED | WNOHANG | WNOWAIT) == -1 &&
+            errno == ECHILD) {
+            fprintf(stderr, "wait: %d: no se puede esperar\n", pids[i]);
+            pids[i] = -1;
+            quedan--;
+        }
+    }
+
+    while (quedan > 0 && !(uno && terminados > 0)) {
+        if (poll(pfd, n + 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        cosechar_pendientes();
+
+        for (i = 0; i < n; i++) {
+            if (pids[i] == -1)
+                continue;
+            // Un hijo ya cosechado no está en la tabla; uno que no es hijo
+            // nuestro sigue en ella aunque su pidfd indique que ha terminado
+            if (buscar_trabajo(pids[i]) != NULL) {
+                if (pfd[i + 1].fd == -1 || !(pfd[i + 1].revents & POLLIN))
+                    continue;
+                eliminar_pid(pids[i], NULL);
+            }
+            mostrar_estado(pids[i]);
+            pids[i] = -1;
+            pfd[i + 1].fd = -1;     // poll() ignora los descriptores negativos
+            quedan--;
+            terminados++;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        if (pidfd[i] != -1)
+            TRY( close(pidfd[i]) );
+}
+
+void run_wait(struct execcmd* ecmd)
+{
+    int opt, error, flag_n, n, i;
+    char* fin;
+    long pid;
+    opt = error = flag_n = 0;
+
+    optind = 0;     // 0 reinicia también el estado interno de getopt (glibc)
+    while (!error && (opt = getopt(ecmd->argc, ecmd->argv, "nh")) != -1) {
+        switch (opt) {
+            case 'n':
+                flag_n = 1;
+                break;
+            case 'h':
+                printf("%s\n", help_wait());
+                return;
+            default:
+                error = 1;
+        }
+    }
+    if (error)
+        return;
+
+    // Sin argumentos, todos los trabajos de la tabla
+    pid_t pids[(optind < ecmd->argc) ? ecmd->argc - optind : g_trabajos.n + 1];
+    n = 0;
+    if (optind == ecmd->argc)
+        for (i = 0; i < g_trabajos.n; i++)
+            pids[n++] = g_trabajos.trabajos[i].pid;
+
+    for (i = optind; i < ecmd->argc; i++) {
+        pid = strtol(ecmd->argv[i], &fin, 10);
+        if (*fin != '\0' || pid <= 0 || pid > INT_MAX) {
+            fprintf(stderr, "wait: PID no válido: '%s'\n", ecmd->argv[i]);
+            return;
+        }
+        if (buscar_trabajo(pid) != NULL)
+            pids[n++] = pid;
+        else if (buscar_terminado(pid) != NULL) {
+            // Ya había terminado: su estado está en el anillo
+            mostrar_estado(pid);
+            if (flag_n)
                 return;
+        }
+        else
+            fprintf(stderr, "wait: %ld no es un trabajo en segundo plano\n", pid);
+    }
+
+    if (n > 0)
+        esperar_trabajos(pids, n, flag_n);
+}
+
+
+/******************************************************************************
+ * Comando interno `pmap`
+ ******************************************************************************/
+
+
+// `pmap` ejecuta una orden por cada elemento de una lista (argumentos tras
+// `:::` o líneas de la entrada estándar), con como mucho N procesos a la vez.
+// Los procesos se lanzan y se cosechan con el mismo planificador que `psplit
+// -p`. En la orden, `{}` se sustituye por el elemento; si no aparece, el
+// elemento se añade al final.
+//
+// Con `-x` cada ejecución recibe varios elementos seguidos (en el lugar del
+// argumento `{}` o al final), tantos como quepan en ARG_MAX, pero repartidos
+// de modo que todos los procesos tengan trabajo.
+
+char * help_pmap()
+{
+    return "Uso: pmap [-j PROCS] [-x] [-h] ORDEN [ARG]... [::: ELEMENTO...]\n\tOpciones:\n\tEjecuta ORDEN una vez por ELEMENTO, sustituyendo {} por él (o añadiéndolo al final).\n\tSin ':::', los elementos se leen de la entrada estándar, uno por línea.\n\t-j PROCS Número máximo de procesos simultáneos (por defecto, uno por CPU).\n\t-x Pasa a cada ejecución tantos elementos como permita ARG_MAX.\n\t-h Ayuda\n";
+}
+
+struct pmap {
+    char** orden;       // ORDEN [ARG]...
+    int n_orden;
+    int llave;          // Posición del argumento `{}` en 'orden' (-1 si no hay)
+    char** elem;
+    int* lote;          // La tarea i recibe los elementos [lote[i], lote[i + 1])
+    int empaquetar;     // -x
+};
+
+// Sustituye cada `{}` de 'arg' por 'elem' (en memoria nueva)
+char* sustituir_llaves(const char* arg, const char* elem)
+{
+    size_t n = strlen(arg), len = strlen(elem);
+    char *res, *d;
+    const char* p;
+
+    for (p = arg; (p = strstr(p, "{}")) != NULL; p += 2)
+        n += len;
+    if ((res = d = malloc(n + 1)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    while ((p = strstr(arg, "{}")) != NULL) {
+        memcpy(d, arg, p - arg);
+        d += p - arg;
+        memcpy(d, elem, len);
+        d += len;
+        arg = p + 2;
+    }
+    strcpy(d, arg);
+    return res;
+}
+
+// Tarea de `planificar`: ejecuta la orden con los elementos de su lote (en el
+// proceso hijo, por lo que no vuelve)
+void ejecutar_lote_pmap(int i, void* datos)
+{
+    struct pmap* pm = datos;
+    int ini = pm->lote[i], n = pm->lote[i + 1] - ini, argc = 0, j;
+    char* argv[pm->n_orden + n + 1];
+    struct execcmd ecmd;
+
+    for (j = 0; j < pm->n_orden; j++) {
+        if (pm->empaquetar && j == pm->llave) {
+            memcpy(&argv[argc], &pm->elem[ini], n * sizeof(char*));
+            argc += n;
+        }
+        else if (!pm->empaquetar && strstr(pm->orden[j], "{}") != NULL)
+            argv[argc++] = sustituir_llaves(pm->orden[j], pm->elem[ini]);
+        else
+            argv[argc++] = pm->orden[j];
+    }
+    if (pm->llave == -1) {
+        memcpy(&argv[argc], &pm->elem[ini], n * sizeof(char*));
+        argc += n;
+    }
+    argv[argc] = NULL;
+
+    ecmd.type = EXEC;
+    ecmd.argc = argc;
+    ecmd.argv = argv;
+    unblock_sigchld();
+    exec_cmd(&ecmd);
+}
+
+// Reparte los 'n' elementos en lotes para 'p' procesos. Sin -x, un elemento
+// por lote. Devuelve el número de lotes.
+int repartir_lotes_pmap(struct pmap* pm, int n, int p)
+{
+    long max, coste, tam;
+    int lotes = 0, objetivo, en_lote, i;
+
+    if ((pm->lote = malloc((n + 1) * sizeof(int))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!pm->empaquetar) {
+        for (i = 0; i <= n; i++)
+            pm->lote[i] = i;
+        return n;
+    }
+
+    // Espacio para los elementos: ARG_MAX menos el entorno, la orden y un
+    // margen, como hace xargs
+    max = sysconf(_SC_ARG_MAX) - 2048;
+    for (char** e = environ; *e != NULL; e++)
+        max -= strlen(*e) + 1 + sizeof(char*);
+    for (i = 0; i < pm->n_orden; i++)
+        max -= strlen(pm->orden[i]) + 1 + sizeof(char*);
+
+    objetivo = (n + p - 1) / p;
+    coste = en_lote = 0;
+    for (i = 0; i < n; i++) {
+        tam = strlen(pm->elem[i]) + 1 + sizeof(char*);
+        if (en_lote > 0 && (en_lote == objetivo || coste + tam > max)) {
+            pm->lote[lotes++] = i - en_lote;
+            coste = en_lote = 0;
+        }
+        coste += tam;
+        en_lote++;
+    }
+    if (en_lote > 0)
+        pm->lote[lotes++] = n - en_lote;
+    pm->lote[lotes] = n;
+
+    return lotes;
+}
+
+// Lee los elementos de la entrada estándar, uno por línea
+char** leer_elementos_pmap(int* n)
+{
+    char** elem = NULL;
+    char* linea = NULL;
+    size_t tam = 0;
+    ssize_t len;
+    int cap = 0;
+
+    *n = 0;
+    while ((len = getline(&linea, &tam, stdin)) != -1) {
+        if (len > 0 && linea[len - 1] == '\n')
+            linea[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (*n == cap) {
+            cap = MAX(2 * cap, MAX_ARGS);
+            if ((elem = realloc(elem, cap * sizeof(char*))) == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        elem[(*n)++] = strdup_o_panic(linea);
+    }
+    if (ferror(stdin)) {
+        perror("pmap: getline");
+        clearerr(stdin);
+    }
+    free(linea);
+
+    return elem;
+}
+
+void run_pmap(struct execcmd* ecmd)
+{
+    int opt, error, p, n, lotes, sep, i, j;
+    struct pmap pm;
+    char** leidos = NULL;
+    opt = error = 0;
+    p = sysconf(_SC_NPROCESSORS_ONLN);
+    memset(&pm, 0, sizeof(pm));
+
+    optind = 0;     // 0 reinicia también el estado interno de getopt (glibc)
+    // '+': las opciones de ORDEN no son de pmap
+    while (!error && (opt = getopt(ecmd->argc, ecmd->argv, "+j:xh")) != -1) {
+        switch (opt) {
+            case 'j':
+                if ((p = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "pmap: Opción -j no válida\n");
+                    error = 1;
+                }
+                break;
+            case 'x':
+                pm.empaquetar = 1;
                 break;
+            case 'h':
+                printf("%s\n", help_pmap());
+                return;
             default:
                 error = 1;
         }
     }
+    if (error)
+        return;
+
+    for (sep = optind; sep < ecmd->argc && strcmp(ecmd->argv[sep], ":::") != 0; sep++)
+        ;
+    pm.orden = &ecmd->argv[optind];
+    pm.n_orden = sep - optind;
+    if (pm.n_orden == 0) {
+        fprintf(stderr, "Uso: pmap [-j PROCS] [-x] [-h] ORDEN [ARG]... [::: ELEMENTO...]\n");
+        return;
+    }
+    pm.llave = -1;
+    for (i = 0; i < pm.n_orden && pm.llave == -1; i++)
+        if (pm.empaquetar ? strcmp(pm.orden[i], "{}") == 0 : strstr(pm.orden[i], "{}") != NULL)
+            pm.llave = i;
+
+    if (sep < ecmd->argc) {
+        pm.elem = &ecmd->argv[sep + 1];
+        n = ecmd->argc - sep - 1;
+    }
+    else
+        pm.elem = leidos = leer_elementos_pmap(&n);
+
+    if (n > 0) {
+        p = MIN(p, n);
+        lotes = repartir_lotes_pmap(&pm, n, p);
+        int estados[lotes];
+
+        DPRINTF(DBG_TRACE, "pmap: %d elementos en %d lotes, %d procesos\n", n, lotes, p);
+        if (!planificar(lotes, MIN(p, lotes), ejecutar_lote_pmap, &pm, estados))
+            for (i = 0; i < lotes; i++) {
+                if (WIFEXITED(estados[i]) && WEXITSTATUS(estados[i]) == EXIT_SUCCESS)
+                    continue;
+                j = pm.lote[i + 1] - pm.lote[i];
+                fprintf(stderr, "pmap: '%s'%s: %s %d\n", pm.elem[pm.lote[i]], j > 1 ? " (y otros)" : "",
+                        WIFSIGNALED(estados[i]) ? "señal" : "salida",
+                        WIFSIGNALED(estados[i]) ? WTERMSIG(estados[i]) : WEXITSTATUS(estados[i]));
+            }
+    }
 
-    if (!error){
-        (flag_k) ? matarTodos_pids() : listar_pids();
+    for (i = 0; leidos != NULL && i < n; i++)
+        free(leidos[i]);
+    free(leidos);
+    free(pm.lote);
+}
+
+
+/******************************************************************************
+ * Caché de rutas de los comandos externos (comando interno `hash`)
+ ******************************************************************************/
+
+
+// Tabla hash (con listas de colisión) que asocia el nombre de un comando con
+// la ruta absoluta en la que se encontró al recorrer $PATH. Se vacía cuando
+// cambia $PATH, y una entrada se olvida si su ruta deja de existir.
+
+#define TAM_HASH 64
+
+struct ruta_cmd {
+    char* nombre;
+    char* ruta;
+    unsigned long aciertos;
+    struct ruta_cmd* sig;
+};
+
+struct ruta_cmd* g_hash[TAM_HASH];
+char* g_hash_path = NULL;           // $PATH con el que se rellenó la tabla
+unsigned long g_hash_aciertos = 0;
+unsigned long g_hash_fallos = 0;
+
+// Función hash djb2 de una cadena
+unsigned hash_cadena(const char* s)
+{
+    unsigned h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char) *s++;
+    return h;
+}
+
+unsigned hash_nombre(const char* nombre)
+{
+    return hash_cadena(nombre) % TAM_HASH;
+}
+
+void vaciar_hash()
+{
+    struct ruta_cmd* r;
+
+    for (int i = 0; i < TAM_HASH; i++)
+        while ((r = g_hash[i]) != NULL) {
+            g_hash[i] = r->sig;
+            free(r->nombre);
+            free(r->ruta);
+            free(r);
+        }
+}
+
+// Elimina de la tabla la entrada de 'nombre', si existe
+void olvidar_ruta(const char* nombre)
+{
+    struct ruta_cmd** r = &g_hash[hash_nombre(nombre)];
+    struct ruta_cmd* borrar;
+
+    while (*r != NULL && strcmp((*r)->nombre, nombre) != 0)
+        r = &(*r)->sig;
+    if ((borrar = *r) != NULL) {
+        *r = borrar->sig;
+        free(borrar->nombre);
+        free(borrar->ruta);
+        free(borrar);
+    }
+}
+
+// Vacía la tabla si $PATH ha cambiado desde que se rellenó
+void comprobar_path()
+{
+    const char* path = getenv("PATH");
+
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+    if (g_hash_path != NULL && strcmp(g_hash_path, path) == 0)
+        return;
+
+    DPRINTF(DBG_TRACE, "hash: PATH cambiado, se vacía la tabla\n");
+    vaciar_hash();
+    free(g_hash_path);
+    if ((g_hash_path = strdup(path)) == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Devuelve la ruta absoluta de 'nombre' según $PATH, consultando primero la
+// tabla. Devuelve NULL si 'nombre' contiene '/', si no se encuentra o si
+// antes de encontrarlo aparece en $PATH un directorio relativo (que no se
+// puede guardar): en esos casos debe resolverlo posix_spawnp()/execvp().
+const char* buscar_ruta(const char* nombre)
+{
+    struct ruta_cmd* r;
+    const char *dir, *fin;
+    struct stat st;
+    size_t ldir, lnom;
+
+    if (strchr(nombre, '/') != NULL)
+        return NULL;
+
+    comprobar_path();
+
+    for (r = g_hash[hash_nombre(nombre)]; r != NULL; r = r->sig)
+        if (strcmp(r->nombre, nombre) == 0) {
+            r->aciertos++;
+            g_hash_aciertos++;
+            DPRINTF(DBG_TRACE, "hash: acierto %s -> %s (aciertos %lu, fallos %lu)\n",
+                    nombre, r->ruta, g_hash_aciertos, g_hash_fallos);
+            return r->ruta;
+        }
+
+    g_hash_fallos++;
+    DPRINTF(DBG_TRACE, "hash: fallo %s (aciertos %lu, fallos %lu)\n",
+            nombre, g_hash_aciertos, g_hash_fallos);
+
+    lnom = strlen(nombre);
+    for (dir = g_hash_path; ; dir = fin + 1) {
+        fin = strchrnul(dir, ':');
+        ldir = fin - dir;
+        if (ldir == 0 || dir[0] != '/')
+            return NULL;
+
+        char ruta[ldir + lnom + 2];
+        memcpy(ruta, dir, ldir);
+        ruta[ldir] = '/';
+        memcpy(ruta + ldir + 1, nombre, lnom + 1);
+
+        if (stat(ruta, &st) == 0 && S_ISREG(st.st_mode) && access(ruta, X_OK) == 0) {
+            if ((r = malloc(sizeof(*r))) == NULL ||
+                (r->nombre = strdup(nombre)) == NULL ||
+                (r->ruta = strdup(ruta)) == NULL) {
+                perror("buscar_ruta: malloc");
+                exit(EXIT_FAILURE);
+            }
+            r->aciertos = 0;
+            r->sig = g_hash[hash_nombre(nombre)];
+            g_hash[hash_nombre(nombre)] = r;
+            return r->ruta;
+        }
+
+        if (*fin == '\0')
+            return NULL;
+    }
+}
+
+char * help_hash()
+{
+    return "Uso: hash [-r] [-h] [NOMBRE]...\n\tOpciones:\n\tNOMBRE Busca NOMBRE en $PATH y lo guarda en la tabla.\n\t-r Vacía la tabla.\n\t-h Ayuda\n";
+}
+
+// Sin argumentos muestra la tabla (aciertos y ruta de cada comando)
+void run_hash(struct execcmd* ecmd)
+{
+    int opt, error, flag_r;
+    struct ruta_cmd* r;
+    opt = error = flag_r = 0;
+
+    optind = 0;     // 0 reinicia también el estado interno de getopt (glibc)
+    while (!error && (opt = getopt(ecmd->argc, ecmd->argv, "rh")) != -1) {
+        switch (opt) {
+            case 'r':
+                flag_r = 1;
+                break;
+            case 'h':
+                printf("%s\n", help_hash());
+                return;
+            default:
+                error = 1;
+        }
+    }
+    if (error)
+        return;
+
+    if (flag_r) {
+        vaciar_hash();
+        g_hash_aciertos = g_hash_fallos = 0;
+    }
+
+    if (optind < ecmd->argc) {
+        for (int i = optind; i < ecmd->argc; i++)
+            if (cmd_esInterno(ecmd->argv[i]) == -1 && buscar_ruta(ecmd->argv[i]) == NULL)
+                fprintf(stderr, "hash: no se encontró el comando '%s'\n", ecmd->argv[i]);
+        return;
+    }
+
+    if (!flag_r) {
+        comprobar_path();
+        for (int i = 0; i < TAM_HASH; i++)
+            for (r = g_hash[i]; r != NULL; r = r->sig)
+                printf("%4lu\t%s\n", r->aciertos, r->ruta);
+        DBLOCK(DBG_TRACE, printf("aciertos: %lu, fallos: %lu\n", g_hash_aciertos, g_hash_fallos));
     }
 }
 
+
 // Devuelve el indice del comando interno que tiene asignado o -1 en caso de no serlo
 int cmd_esInterno(char* cmd)
 {
@@ -859,6 +3277,15 @@ int cmd_esInterno(char* cmd)
 
 // En funcion del numeroComando proporcionado, ejecuta el metodo correspondiente
 void ejecutar_interno(struct execcmd* ecmd, int numeroComando) {
+    // Los comandos internos reciben una copia de 'argv' porque getopt() lo
+    // permuta y el árbol puede estar guardado en la caché de planes
+    char* argv[ecmd->argc + 1];
+    struct execcmd copia = *ecmd;
+
+    memcpy(argv, ecmd->argv, (ecmd->argc + 1) * sizeof(char*));
+    copia.argv = argv;
+    ecmd = &copia;
+
     switch (numeroComando) {
         case 0:
             run_cwd();
@@ -878,6 +3305,15 @@ void ejecutar_interno(struct execcmd* ecmd, int numeroComando) {
         case 4:
             run_bjobs(ecmd);
             break;
+        case 5:
+            run_hash(ecmd);
+            break;
+        case 6:
+            run_wait(ecmd);
+            break;
+        case 7:
+            run_pmap(ecmd);
+            break;
     }
 }
 
@@ -893,15 +3329,46 @@ void ejecutar_interno(struct execcmd* ecmd, int numeroComando) {
 //
 // `get_token` devuelve un *token* de la cadena de entrada.
 
+// Final de un argumento seguido directamente de un carácter especial (p.ej.
+// `ls>f`). No se puede terminar en '\0' al reconocer el argumento porque aún
+// hay que leer el carácter especial: se termina cuando `get_token` lo consume
+// (o en `parse_cmd`, si ya no se consume).
+static char* g_fin_pendiente = NULL;
+
+// Devuelve la primera posición de [s, end_of_str) con un delimitador o un
+// carácter especial, o `end_of_str` si no la hay. Los argumentos largos
+// (p.ej. listas de ficheros generadas) se recorren de 16 en 16 bytes.
+static inline char* fin_argumento(char* s, char const* end_of_str)
+{
+#ifdef __SSE2__
+    static const char especiales[] = " \t\r\n\v<|>&;()";
+
+    while (s + 16 <= end_of_str) {
+        __m128i x = _mm_loadu_si128((const __m128i*) s);
+        __m128i m = _mm_cmpeq_epi8(x, _mm_setzero_si128());
+        for (int i = 0; i < (int) sizeof(especiales) - 1; i++)
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(especiales[i])));
+        unsigned k = _mm_movemask_epi8(m);
+        if (k)
+            return s + __builtin_ctz(k);
+        s += 16;
+    }
+#endif
+    while (s < end_of_str && !CLASE[(unsigned char) *s])
+        s++;
+    return s;
+}
+
 int get_token(char** start_of_str, char const* end_of_str,
         char** start_of_token, char** end_of_token)
 {
     char* s;
+    char* simbolo = NULL;
     int ret;
 
     // Salta los espacios en blanco
     s = *start_of_str;
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && CLASE[(unsigned char) *s] == BLANCO)
         s++;
 
     // `start_of_token` apunta al principio del argumento (si no es NULL)
@@ -919,9 +3386,11 @@ int get_token(char** start_of_str, char const* end_of_str,
         case ';':
         case '&':
         case '<':
+            simbolo = s;
             s++;
             break;
         case '>':
+            simbolo = s;
             s++;
             if (*s == '>')
             {
@@ -945,12 +3414,18 @@ int get_token(char** start_of_str, char const* end_of_str,
             //     |-----------+---+---+---+---+---+---+---+---+---+-----------|
             //                   ^                                   ^
             //            start_o|f_token                       end_o|f_token
+            //
+            // El argumento queda terminado en '\0' sobre el delimitador que
+            // le sigue, sin tener que recorrer de nuevo la línea después.
 
             ret = 'a';
-            while (s < end_of_str &&
-                    !strchr(WHITESPACE, *s) &&
-                    !strchr(SYMBOLS, *s))
-                s++;
+            s = fin_argumento(s, end_of_str);
+            if (s < end_of_str) {
+                if (CLASE[(unsigned char) *s] == BLANCO)
+                    *s = 0;
+                else
+                    g_fin_pendiente = s;
+            }
             break;
     }
 
@@ -959,9 +3434,15 @@ int get_token(char** start_of_str, char const* end_of_str,
         *end_of_token = s;
 
     // Salta los espacios en blanco
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && CLASE[(unsigned char) *s] == BLANCO)
         s++;
 
+    // Termina el argumento anterior sobre el carácter especial ya consumido
+    if (simbolo != NULL && simbolo == g_fin_pendiente) {
+        *simbolo = 0;
+        g_fin_pendiente = NULL;
+    }
+
     // Actualiza `start_of_str`
     *start_of_str = s;
 
@@ -974,17 +3455,17 @@ int get_token(char** start_of_str, char const* end_of_str,
 // (`delimiter`).
 //
 // El primer puntero pasado como parámero (`start_of_str`) avanza hasta el
-// primer carácter que no está en el conjunto de caracteres `WHITESPACE`.
+// primer carácter que no es un delimitador (clase `BLANCO`).
 //
 // `peek` devuelve un valor distinto de `NULL` si encuentra alguno de los
-// caracteres en `delimiter` justo después de los caracteres en `WHITESPACE`.
+// caracteres en `delimiter` justo después de los delimitadores.
 
 int peek(char** start_of_str, char const* end_of_str, char* delimiter)
 {
     char* s;
 
     s = *start_of_str;
-    while (s < end_of_str && strchr(WHITESPACE, *s))
+    while (s < end_of_str && CLASE[(unsigned char) *s] == BLANCO)
         s++;
     *start_of_str = s;
 
@@ -992,13 +3473,32 @@ int peek(char** start_of_str, char const* end_of_str, char* delimiter)
 }
 
 
+// `consumir_palabra` avanza `start_of_str` tras la palabra `palabra` si es lo
+// siguiente que hay en la cadena (seguida de un blanco, un carácter especial
+// o el final). Devuelve 0 y no avanza si no la encuentra.
+
+int consumir_palabra(char** start_of_str, char const* end_of_str, const char* palabra)
+{
+    size_t len = strlen(palabra);
+    char* s;
+
+    peek(start_of_str, end_of_str, "");
+    s = *start_of_str;
+    if ((size_t) (end_of_str - s) < len || strncmp(s, palabra, len) != 0 ||
+        (s + len < end_of_str && CLASE[(unsigned char) s[len]] == 0))
+        return 0;
+
+    *start_of_str = s + len;
+    return 1;
+}
+
+
 // Definiciones adelantadas de funciones
 struct cmd* parse_line(char**, char*);
 struct cmd* parse_pipe(char**, char*);
 struct cmd* parse_exec(char**, char*);
 struct cmd* parse_subs(char**, char*);
 struct cmd* parse_redr(struct cmd*, char**, char*);
-struct cmd* null_terminate(struct cmd*);
 
 
 // `parse_cmd` realiza el *análisis sintáctico* de la línea de órdenes
@@ -1014,13 +3514,18 @@ struct cmd* parse_cmd(char* start_of_str)
     DPRINTF(DBG_TRACE, "STR\n");
 
     end_of_str = start_of_str + strlen(start_of_str);
+    g_fin_pendiente = NULL;
 
     cmd = parse_line(&start_of_str, end_of_str);
 
     // Comprueba que se ha alcanzado el final de la línea de órdenes
     peek(&start_of_str, end_of_str, "");
     if (start_of_str != end_of_str)
-        error("%s: error sintáctico: %s\n", __func__);
+        error("%s: error sintáctico: %s\n", __func__, start_of_str);
+
+    // Termina el último argumento si le seguía un carácter no consumido
+    if (g_fin_pendiente != NULL)
+        *g_fin_pendiente = 0;
 
     DPRINTF(DBG_TRACE, "END\n");
 
@@ -1036,11 +3541,20 @@ struct cmd* parse_cmd(char* start_of_str)
 // bloques de órdenes y/o redirecciones.  A continuación, `parse_line`
 // comprueba si la ejecución de la línea se realiza en segundo plano (con `&`)
 // o si la línea de órdenes contiene una lista de órdenes (con `;`).
+//
+// Si la línea empieza por la palabra `time` (y opcionalmente `-d`), todo lo
+// que sigue, hasta el final de la línea o del bloque, se cronometra.
 
 struct cmd* parse_line(char** start_of_str, char* end_of_str)
 {
     struct cmd* cmd;
-    int delimiter;
+    int delimiter, formato;
+
+    if (consumir_palabra(start_of_str, end_of_str, "time"))
+    {
+        formato = consumir_palabra(start_of_str, end_of_str, "-d") ? TIEMPO_DATOS : TIEMPO_TEXTO;
+        return timecmd(parse_line(start_of_str, end_of_str), formato);
+    }
 
     cmd = parse_pipe(start_of_str, end_of_str);
 
@@ -1110,9 +3624,12 @@ struct cmd* parse_exec(char** start_of_str, char* end_of_str)
 {
     char* start_of_token;
     char* end_of_token;
-    int token, argc;
+    int token, argc, cap;
     struct execcmd* cmd;
     struct cmd* ret;
+    char* pila[MAX_ARGS];
+    char** argv = pila;
+    char** mayor;
 
     // ¿Inicio de un bloque?
     if (peek(start_of_str, end_of_str, "("))
@@ -1129,6 +3646,7 @@ struct cmd* parse_exec(char** start_of_str, char* end_of_str)
 
     // Bucle para separar los argumentos de las posibles redirecciones
     argc = 0;
+    cap = MAX_ARGS;
     while (!peek(start_of_str, end_of_str, "|)&;"))
     {
         if ((token = get_token(start_of_str, end_of_str,
@@ -1142,19 +3660,29 @@ struct cmd* parse_exec(char** start_of_str, char* end_of_str)
 
         // Almacena el siguiente argumento reconocido. El primero es
         // el comando
-        cmd->argv[argc] = start_of_token;
-        cmd->eargv[argc] = end_of_token;
+        argv[argc] = start_of_token;
         cmd->argc = ++argc;
-        if (argc >= MAX_ARGS)
-            panic("%s: demasiados argumentos\n", __func__);
+        if (argc == cap) {
+            mayor = arena_reservar(g_arena, 2 * cap * sizeof(char*));
+            memcpy(mayor, argv, argc * sizeof(char*));
+            argv = mayor;
+            cap *= 2;
+        }
 
         // ¿Redirecciones después del comando?
         ret = parse_redr(ret, start_of_str, end_of_str);
     }
 
     // El comando no tiene más parámetros
-    cmd->argv[argc] = 0;
-    cmd->eargv[argc] = 0;
+    argv[argc] = 0;
+
+    // Sólo se guardan en la arena los argumentos que tiene el comando
+    if (argv == pila) {
+        cmd->argv = arena_reservar(g_arena, (argc + 1) * sizeof(char*));
+        memcpy(cmd->argv, argv, (argc + 1) * sizeof(char*));
+    }
+    else
+        cmd->argv = argv;
 
     return ret;
 }
@@ -1223,13 +3751,13 @@ struct cmd* parse_redr(struct cmd* cmd, char** start_of_str, char* end_of_str)
         switch(delimiter)
         {
             case '<':
-                cmd = redrcmd(cmd, start_of_token, end_of_token, O_RDONLY, S_IRWXU, STDIN_FILENO);
+                cmd = redrcmd(cmd, start_of_token, O_RDONLY, S_IRWXU, STDIN_FILENO);
                 break;
             case '>':
-                cmd = redrcmd(cmd, start_of_token, end_of_token, O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU, STDOUT_FILENO);
+                cmd = redrcmd(cmd, start_of_token, O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU, STDOUT_FILENO);
                 break;
             case '+': // >>
-                cmd = redrcmd(cmd, start_of_token, end_of_token, O_WRONLY|O_CREAT|O_APPEND, S_IRWXU, STDOUT_FILENO);
+                cmd = redrcmd(cmd, start_of_token, O_WRONLY|O_CREAT|O_APPEND, S_IRWXU, STDOUT_FILENO);
                 break;
         }
     }
@@ -1238,79 +3766,229 @@ struct cmd* parse_redr(struct cmd* cmd, char** start_of_str, char* end_of_str)
 }
 
 
-// Termina en NULL todas las cadenas de las estructuras `cmd`
-struct cmd* null_terminate(struct cmd* cmd)
+
+
+/******************************************************************************
+ * Funciones para la ejecución de la línea de órdenes
+ ******************************************************************************/
+
+
+void exec_cmd(struct execcmd* ecmd)
 {
-    struct execcmd* ecmd;
-    struct redrcmd* rcmd;
-    struct pipecmd* pcmd;
-    struct listcmd* lcmd;
-    struct backcmd* bcmd;
-    struct subscmd* scmd;
-    int i;
+    assert(ecmd->type == EXEC);
 
-    if(cmd == 0)
-        return 0;
+    if (ecmd->argv[0] == NULL) exit(EXIT_SUCCESS);
 
-    switch(cmd->type)
-    {
-        case EXEC:
-            ecmd = (struct execcmd*) cmd;
-            for(i = 0; ecmd->argv[i]; i++)
-                *ecmd->eargv[i] = 0;
-            break;
+    const char* ruta = buscar_ruta(ecmd->argv[0]);
+    if (ruta != NULL)
+        execv(ruta, ecmd->argv);
 
-        case REDR:
-            rcmd = (struct redrcmd*) cmd;
-            null_terminate(rcmd->cmd);
-            *rcmd->efile = 0;
-            break;
+    execvp(ecmd->argv[0], ecmd->argv);
 
-        case PIPE:
-            pcmd = (struct pipecmd*) cmd;
-            null_terminate(pcmd->left);
-            null_terminate(pcmd->right);
-            break;
+    panic("no se encontró el comando '%s'\n", ecmd->argv[0]);
+}
 
-        case LIST:
-            lcmd = (struct listcmd*) cmd;
-            null_terminate(lcmd->left);
-            null_terminate(lcmd->right);
-            break;
 
-        case BACK:
-            bcmd = (struct backcmd*) cmd;
-            null_terminate(bcmd->cmd);
-            break;
+// Devuelve 'ecmd' si es un comando externo (ni vacío ni interno), o NULL
+struct execcmd* externo(struct cmd* cmd)
+{
+    struct execcmd* ecmd = (struct execcmd*) cmd;
 
-        case SUBS:
-            scmd = (struct subscmd*) cmd;
-            null_terminate(scmd->cmd);
-            break;
+    if (cmd->type != EXEC || ecmd->argv[0] == NULL || cmd_esInterno(ecmd->argv[0]) != -1)
+        return NULL;
+    return ecmd;
+}
+
+// Lanza el comando externo 'ecmd' con posix_spawnp(), que en glibc crea el hijo
+// con clone(CLONE_VM|CLONE_VFORK) y no copia las tablas de páginas del shell.
+// 'acciones' (puede ser NULL) son las redirecciones que el hijo aplica antes de
+// execve(). El hijo arranca con la máscara de señales del shell sin SIGCHLD.
+// Devuelve el PID del hijo o -1 si no se pudo ejecutar el comando.
+pid_t spawn_cmd(struct execcmd* ecmd, const posix_spawn_file_actions_t* acciones)
+{
+    posix_spawnattr_t attr;
+    sigset_t mascara;
+    pid_t pid;
+    int err;
+
+    TRY( sigprocmask(SIG_BLOCK, NULL, &mascara) );
+    TRY( sigdelset(&mascara, SIGCHLD) );
+
+    if ((err = posix_spawnattr_init(&attr)) != 0 ||
+        (err = posix_spawnattr_setsigmask(&attr, &mascara)) != 0 ||
+        (err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK)) != 0)
+        panic("posix_spawnattr: %s\n", strerror(err));
+
+    // La ruta de la caché se ejecuta directamente; si ha dejado de existir se
+    // olvida y se vuelve a buscar
+    const char* ruta = buscar_ruta(ecmd->argv[0]);
+    if (ruta != NULL && (err = posix_spawn(&pid, ruta, acciones, &attr, ecmd->argv, environ)) == ENOENT) {
+        olvidar_ruta(ecmd->argv[0]);
+        ruta = buscar_ruta(ecmd->argv[0]);
+        if (ruta != NULL)
+            err = posix_spawn(&pid, ruta, acciones, &attr, ecmd->argv, environ);
+    }
+    if (ruta == NULL)
+        err = posix_spawnp(&pid, ecmd->argv[0], acciones, &attr, ecmd->argv, environ);
+    posix_spawnattr_destroy(&attr);
+
+    if (err == ENOENT) {
+        error("no se encontró el comando '%s'\n", ecmd->argv[0]);
+        return -1;
+    }
+    if (err != 0) {
+        error("%s: %s\n", ecmd->argv[0], strerror(err));
+        return -1;
+    }
+
+    DPRINTF(DBG_TRACE, "spawn %s [%d]\n", ecmd->argv[0], pid);
+    return pid;
+}
+
+// Lanza el comando externo 'ecmd' con las redirecciones de 'rcmd' y de las
+// redirecciones anidadas bajo él. Los ficheros se abren en el shell (en el
+// mismo orden que con fork(), de la más externa a la más interna) y el hijo
+// sólo los duplica sobre sus descriptores, con lo que gana la más interna.
+pid_t spawn_redr(struct redrcmd* rcmd, struct execcmd* ecmd)
+{
+    posix_spawn_file_actions_t acciones;
+    struct cmd* c;
+    pid_t pid;
+    int n, i;
+
+    n = 0;
+    for (c = (struct cmd*) rcmd; c->type == REDR; c = ((struct redrcmd*) c)->cmd)
+        n++;
+
+    int fds[n];
+
+    TRY( posix_spawn_file_actions_init(&acciones) );
+    for (i = 0, c = (struct cmd*) rcmd; i < n; i++, c = ((struct redrcmd*) c)->cmd) {
+        struct redrcmd* r = (struct redrcmd*) c;
+
+        if ((fds[i] = open(r->file, r->flags | O_CLOEXEC, r->mode)) < 0)
+        {
+            perror("open");
+            exit(EXIT_FAILURE);
+        }
+        TRY( posix_spawn_file_actions_adddup2(&acciones, fds[i], r->fd) );
+    }
+
+    pid = spawn_cmd(ecmd, &acciones);
+
+    posix_spawn_file_actions_destroy(&acciones);
+    for (i = 0; i < n; i++)
+        TRY( close(fds[i]) );
+
+    return pid;
+}
+
+// Las tuberías se ejecutan aplanadas: `parse_pipe` construye un árbol
+// anidado por la derecha, pero todas las etapas se lanzan desde el propio
+// shell, unidas por N-1 tuberías, y se esperan juntas al final.
+
+// Número de etapas de la tubería 'cmd'
+int contar_etapas(struct cmd* cmd)
+{
+    struct pipecmd* pcmd = (struct pipecmd*) cmd;
+
+    if (cmd->type != PIPE)
+        return 1;
+    return contar_etapas(pcmd->left) + contar_etapas(pcmd->right);
+}
+
+// Guarda en 'etapas' las etapas de la tubería 'cmd' de izquierda a derecha y
+// devuelve cuántas ha guardado
+int aplanar_tuberia(struct cmd* cmd, struct cmd** etapas)
+{
+    struct pipecmd* pcmd = (struct pipecmd*) cmd;
+    int n;
+
+    if (cmd->type != PIPE) {
+        etapas[0] = cmd;
+        return 1;
+    }
+    n = aplanar_tuberia(pcmd->left, etapas);
+    return n + aplanar_tuberia(pcmd->right, etapas + n);
+}
 
-        case INV:
-        default:
-            panic("%s: estructura `cmd` desconocida\n", __func__);
+// Lanza el comando externo 'ecmd' como etapa de una tubería, leyendo de
+// 'entrada' y escribiendo en 'salida' (-1 si no se redirigen). En el hijo
+// se cierran los dos extremos de las 'n' tuberías de 'tubos'.
+pid_t spawn_etapa(struct execcmd* ecmd, int entrada, int salida, int (*tubos)[2], int n)
+{
+    posix_spawn_file_actions_t acciones;
+    pid_t pid;
+
+    TRY( posix_spawn_file_actions_init(&acciones) );
+    if (entrada != -1)
+        TRY( posix_spawn_file_actions_adddup2(&acciones, entrada, STDIN_FILENO) );
+    if (salida != -1)
+        TRY( posix_spawn_file_actions_adddup2(&acciones, salida, STDOUT_FILENO) );
+    for (int i = 0; i < n; i++) {
+        TRY( posix_spawn_file_actions_addclose(&acciones, tubos[i][0]) );
+        TRY( posix_spawn_file_actions_addclose(&acciones, tubos[i][1]) );
     }
 
-    return cmd;
+    pid = spawn_cmd(ecmd, &acciones);
+
+    posix_spawn_file_actions_destroy(&acciones);
+    return pid;
 }
 
+// Ejecuta la tubería 'cmd' con una etapa por proceso
+void run_tuberia(struct cmd* cmd)
+{
+    struct execcmd* ecmd;
+    int n = contar_etapas(cmd);
+    struct cmd* etapas[n];
+    int tubos[n - 1][2];
+    pid_t pids[n];
+    int i, j, entrada, salida;
 
-/******************************************************************************
- * Funciones para la ejecución de la línea de órdenes
- ******************************************************************************/
+    aplanar_tuberia(cmd, etapas);
 
+    for (i = 0; i < n - 1; i++)
+        if (pipe(tubos[i]) < 0)
+        {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
 
-void exec_cmd(struct execcmd* ecmd)
-{
-    assert(ecmd->type == EXEC);
+    for (i = 0; i < n; i++) {
+        entrada = (i > 0) ? tubos[i - 1][0] : -1;
+        salida = (i < n - 1) ? tubos[i][1] : -1;
 
-    if (ecmd->argv[0] == NULL) exit(EXIT_SUCCESS);
+        if ((ecmd = externo(etapas[i])) != NULL) {
+            pids[i] = spawn_etapa(ecmd, entrada, salida, tubos, n - 1);
+            continue;
+        }
 
-    execvp(ecmd->argv[0], ecmd->argv);
+        // Comandos internos y compuestos: hijo con copia del shell
+        if ((pids[i] = fork_or_panic("fork PIPE")) == 0)
+        {
+            if (entrada != -1) {
+                TRY( close(STDIN_FILENO) );
+                TRY( dup(entrada) );
+            }
+            if (salida != -1) {
+                TRY( close(STDOUT_FILENO) );
+                TRY( dup(salida) );
+            }
+            for (j = 0; j < n - 1; j++) {
+                TRY( close(tubos[j][0]) );
+                TRY( close(tubos[j][1]) );
+            }
+            run_cmd_final(etapas[i]);
+        }
+    }
 
-    panic("no se encontró el comando '%s'\n", ecmd->argv[0]);
+    for (i = 0; i < n - 1; i++) {
+        TRY( close(tubos[i][0]) );
+        TRY( close(tubos[i][1]) );
+    }
+
+    esperar_hijos(pids, n, NULL);
 }
 
 void run_cmd(struct cmd* cmd)
@@ -1318,13 +3996,12 @@ void run_cmd(struct cmd* cmd)
     struct execcmd* ecmd;
     struct redrcmd* rcmd;
     struct listcmd* lcmd;
-    struct pipecmd* pcmd;
     struct backcmd* bcmd;
     struct subscmd* scmd;
-    int p[2];
     int fd;
 
     int comando;    // almacenará el número de comando interno o -1
+    int en_cola;
     pid_t pid;      // 'pid' almacena el PID del proceso hijo al que se espera tras hacer un fork
 
     DPRINTF(DBG_TRACE, "STR\n");
@@ -1339,13 +4016,8 @@ void run_cmd(struct cmd* cmd)
 	            comando = cmd_esInterno(ecmd->argv[0]);
 	            if (comando != -1)
 	                ejecutar_interno(ecmd, comando);
-	            else {
-                    block_sigchld();
-	                if ((pid = fork_or_panic("fork EXEC")) == 0)
-	                    exec_cmd(ecmd);
-	                TRY( waitpid(pid, 0, 0) );
-                    unblock_sigchld();
-	            }
+	            else if ((pid = spawn_cmd(ecmd, NULL)) > 0)
+	                esperar_pid(pid);
 	        }
             break;
 
@@ -1353,6 +4025,18 @@ void run_cmd(struct cmd* cmd)
 
             rcmd = (struct redrcmd*) cmd;
 
+            // Un comando externo bajo una o varias redirecciones no necesita
+            // un hijo con copia del shell: se lanza con las redirecciones
+            struct cmd* c = rcmd->cmd;
+            while (c->type == REDR)
+                c = ((struct redrcmd*) c)->cmd;
+            if ((ecmd = externo(c)) != NULL)
+            {
+                if ((pid = spawn_redr(rcmd, ecmd)) > 0)
+                    esperar_pid(pid);
+                break;
+            }
+
             int fd_anterior;
             if ((fd_anterior = dup(rcmd->fd)) == -1){   // Guardamos el anterior descriptor de fichero
                 perror("dup");
@@ -1376,24 +4060,15 @@ void run_cmd(struct cmd* cmd)
             }
             else 
             {
-                block_sigchld();
                 if ((pid = fork_or_panic("fork REDR")) == 0)
-                {
-                    if (rcmd->cmd->type == EXEC)
-                        exec_cmd(ecmd);
-                    else
-                        run_cmd(rcmd->cmd);
-
-                    exit(EXIT_SUCCESS);
-                }
+                    run_cmd_final(rcmd->cmd);
 
-                TRY( waitpid(pid, 0, 0) );
+                esperar_pid(pid);
                 TRY ( close(fd) );
                 if ((fd = dup(fd_anterior)) == -1){
                     perror("dup");
                     exit(EXIT_FAILURE);
                 }
-                unblock_sigchld();
             }
  
    			TRY ( close(fd_anterior) );
@@ -1407,100 +4082,35 @@ void run_cmd(struct cmd* cmd)
             break;
 
         case PIPE:
-            pcmd = (struct pipecmd*)cmd;
-            if (pipe(p) < 0)
-            {
-                perror("pipe");
-                exit(EXIT_FAILURE);
-            }
-
-            // Ejecución del hijo de la izquierda
-            pid_t pid_izq;
-            block_sigchld();
-            if ((pid_izq = fork_or_panic("fork PIPE left")) == 0)
-            {
-                TRY( close(STDOUT_FILENO) );
-                TRY( dup(p[1]) );
-                TRY( close(p[0]) );
-                TRY( close(p[1]) );
-                if (pcmd->left->type == EXEC){
-                    ecmd = (struct execcmd*) pcmd->left;
-
-                    comando = cmd_esInterno(ecmd->argv[0]);
-                    if (comando != -1)
-                        ejecutar_interno(ecmd, comando);
-                    else
-                        exec_cmd(ecmd);
-                }
-                else
-                    run_cmd(pcmd->left);
-                exit(EXIT_SUCCESS);
-            }
-
-            // Ejecución del hijo de la derecha
-            pid_t pid_der;
-            if ((pid_der = fork_or_panic("fork PIPE right")) == 0)
-            {
-                TRY( close(STDIN_FILENO) );
-                TRY( dup(p[0]) );
-                TRY( close(p[0]) );
-                TRY( close(p[1]) );
-                if (pcmd->right->type == EXEC){
-                    ecmd = (struct execcmd*) pcmd->right;
-
-                    comando = cmd_esInterno(ecmd->argv[0]);
-                    if (comando != -1)
-                        ejecutar_interno(ecmd, comando);
-                    else
-                        exec_cmd(ecmd);
-                }
-                else
-                    run_cmd(pcmd->right);
-                exit(EXIT_SUCCESS);
-            }
-            TRY( close(p[0]) );
-            TRY( close(p[1]) );
-
-            TRY( waitpid(pid_izq, 0, 0) );
-            TRY( waitpid(pid_der, 0, 0) );
-            unblock_sigchld();
+            run_tuberia(cmd);
             break;
 
         case BACK:
             bcmd = (struct backcmd*)cmd;
-            if ((pid = fork_or_panic("fork BACK")) == 0)
-            {
-                if (bcmd->cmd->type == EXEC){
-                    ecmd = (struct execcmd*) bcmd->cmd;
-
-                    comando = cmd_esInterno(ecmd->argv[0]);
-                    if (comando != -1)
-                        ejecutar_interno(ecmd, comando);
-                    else
-                        exec_cmd(ecmd);
-                }
-                else
-                    run_cmd(bcmd->cmd);
-
-                exit(EXIT_SUCCESS);
-            }
-            else
+            // El hijo sólo se cosecha después (de forma síncrona), así que
+            // su PID siempre está en la tabla cuando se notifica su fin
+            if ((en_cola = !hay_hueco()))
+                pid = lanzar_en_espera(bcmd->cmd);
+            else if ((ecmd = externo(bcmd->cmd)) != NULL)
+                pid = spawn_cmd(ecmd, NULL);
+            else if ((pid = fork_or_panic("fork BACK")) == 0)
+                run_cmd_final(bcmd->cmd);
+            if (pid > 0)
             {
                 printf("[%d]\n", pid);
-                guardar_pid(pid);
+                guardar_pid(pid, en_cola);
             }
             break;
 
         case SUBS:
             scmd = (struct subscmd*) cmd;
-            block_sigchld();
             if ((pid = fork_or_panic("fork SUBS")) == 0)
-            {
-                run_cmd(scmd->cmd);
-                exit(EXIT_SUCCESS);
-            }
-            TRY( waitpid(pid, 0, 0) );
-            unblock_sigchld();
+                run_cmd_final(scmd->cmd);
+            esperar_pid(pid);
+            break;
+
+        case TIME:
+            run_time((struct timecmd*) cmd);
             break;
 
         case INV:
@@ -1512,6 +4122,105 @@ void run_cmd(struct cmd* cmd)
 }
 
 
+// Ejecuta 'cmd' como última acción de un proceso hijo y termina el proceso.
+// Como después no queda nada por hacer en el hijo, un comando externo se
+// ejecuta con exec() directamente en lugar de crear otro hijo y esperarlo, y
+// los subshells y redirecciones no necesitan un nuevo fork(): así `(sleep 5) &`
+// o `((grep x f)) > out` dejan un único proceso en lugar de uno por nivel.
+void run_cmd_final(struct cmd* cmd)
+{
+    struct execcmd* ecmd;
+    struct redrcmd* rcmd;
+    struct listcmd* lcmd;
+    int comando;
+
+    // Se desciende por el árbol mientras la última acción sea un subcomando
+    while (cmd != 0)
+    {
+        switch(cmd->type)
+        {
+            case EXEC:
+                ecmd = (struct execcmd*) cmd;
+                if (ecmd->argv[0] != NULL && (comando = cmd_esInterno(ecmd->argv[0])) != -1)
+                    ejecutar_interno(ecmd, comando);
+                else {
+                    // Los comandos externos arrancan con SIGCHLD desbloqueada
+                    unblock_sigchld();
+                    exec_cmd(ecmd);
+                }
+                exit(EXIT_SUCCESS);
+
+            case REDR:
+                // El hijo no tiene que restaurar el descriptor al terminar
+                rcmd = (struct redrcmd*) cmd;
+                TRY( close(rcmd->fd) );
+                if (open(rcmd->file, rcmd->flags, rcmd->mode) < 0)
+                {
+                    perror("open");
+                    exit(EXIT_FAILURE);
+                }
+                cmd = rcmd->cmd;
+                break;
+
+            case SUBS:
+                // Ya estamos en un proceso aparte del shell
+                cmd = ((struct subscmd*) cmd)->cmd;
+                break;
+
+            case LIST:
+                lcmd = (struct listcmd*) cmd;
+                run_cmd(lcmd->left);
+                cmd = lcmd->right;
+                break;
+
+            default:
+                run_cmd(cmd);
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+// Segundos de CPU de usuario y de sistema consumidos entre 'antes' y 'despues'
+double dif_cpu(struct timeval* antes, struct timeval* despues)
+{
+    return (despues->tv_sec - antes->tv_sec) + (despues->tv_usec - antes->tv_usec) / 1e6;
+}
+
+// Ejecuta el comando de `time` y muestra en stderr el tiempo real
+// (CLOCK_MONOTONIC) y la CPU de usuario y de sistema que ha consumido. La CPU
+// es la del propio shell (comandos internos como `cd` o `psplit`) más la de
+// los hijos esperados mientras tanto (tuberías, subshells, comandos externos).
+void run_time(struct timecmd* tcmd)
+{
+    struct rusage propio[2], hijos[2];
+    struct timespec inicio;
+    double real, user, sys;
+
+    TRY( getrusage(RUSAGE_SELF, &propio[0]) );
+    TRY( getrusage(RUSAGE_CHILDREN, &hijos[0]) );
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+
+    run_cmd(tcmd->cmd);
+
+    real = segundos_desde(&inicio);
+    TRY( getrusage(RUSAGE_SELF, &propio[1]) );
+    TRY( getrusage(RUSAGE_CHILDREN, &hijos[1]) );
+
+    user = dif_cpu(&propio[0].ru_utime, &propio[1].ru_utime) +
+           dif_cpu(&hijos[0].ru_utime, &hijos[1].ru_utime);
+    sys = dif_cpu(&propio[0].ru_stime, &propio[1].ru_stime) +
+          dif_cpu(&hijos[0].ru_stime, &hijos[1].ru_stime);
+
+    // Lo que haya escrito el comando sale antes que los tiempos
+    fflush(stdout);
+    if (tcmd->formato == TIEMPO_DATOS)
+        fprintf(stderr, "{\"real\": %.9f, \"user\": %.6f, \"sys\": %.6f}\n", real, user, sys);
+    else
+        fprintf(stderr, "\nreal\t%.6f s\nuser\t%.6f s\nsys\t%.6f s\n", real, user, sys);
+}
+
 void print_cmd(struct cmd* cmd)
 {
     struct execcmd* ecmd;
@@ -1580,6 +4289,12 @@ void print_cmd(struct cmd* cmd)
             printf(" )");
             break;
 
+        case TIME:
+            printf("time( ");
+            print_cmd(((struct timecmd*) cmd)->cmd);
+            printf(" )");
+            break;
+
         case INV:
         default:
             panic("%s: estructura `cmd` desconocida\n", __func__);
@@ -1587,117 +4302,276 @@ void print_cmd(struct cmd* cmd)
 }
 
 
-void free_cmd(struct cmd* cmd)
+/******************************************************************************
+ * Lectura de la línea de órdenes con la biblioteca libreadline
+ ******************************************************************************/
+
+
+// `get_cmd` muestra un *prompt* y lee lo que el usuario escribe usando la
+// biblioteca readline. Ésta permite mantener el historial, utilizar las flechas
+// para acceder a las órdenes previas del historial, búsquedas de órdenes, etc.
+
+// El *prompt* se guarda ya construido y sólo se rehace cuando cambia el
+// directorio de trabajo (`run_cd` lo invalida). El nombre de usuario se
+// resuelve una sola vez, porque getpwuid() puede consultar NSS en cada llamada.
+char* g_usuario = NULL;
+char* g_prompt = NULL;
+int g_prompt_valido = 0;
+
+void actualizar_prompt()
 {
-    struct execcmd* ecmd;
-    struct redrcmd* rcmd;
-    struct listcmd* lcmd;
-    struct pipecmd* pcmd;
-    struct backcmd* bcmd;
-    struct subscmd* scmd;
+    if (g_usuario == NULL) {
+        struct passwd* passwd = getpwuid(getuid());
+        if (!passwd) {
+            perror("getpwuid");
+            exit(EXIT_FAILURE);
+        }
+        if ((g_usuario = strdup(passwd->pw_name)) == NULL) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if(cmd == 0) return;
+    char path[PATH_MAX];
+    if(!getcwd(path, PATH_MAX)){
+        perror("getcwd");
+        exit(EXIT_FAILURE);
+    }
 
-    switch(cmd->type)
-    {
-        case EXEC:
-            break;
+    char* dir = basename(path);
 
-        case REDR:
-            rcmd = (struct redrcmd*) cmd;
-            free_cmd(rcmd->cmd);
+    free(g_prompt);
+    if (asprintf(&g_prompt, "%s@%s> ", g_usuario, dir) == -1) {
+        perror("asprintf");
+        exit(EXIT_FAILURE);
+    }
+    g_prompt_valido = 1;
+}
 
-            free(rcmd->cmd);
-            break;
+// Mientras el usuario escribe, readline se usa con su interfaz de *callbacks*
+// para esperar a la vez en el terminal y en 'g_sigchld_fd': los procesos en
+// segundo plano que terminan se cosechan y se notifican en ese momento, igual
+// que hacía antes el manejador de SIGCHLD.
+char* g_linea_leida;
+int g_linea_lista;
 
-        case LIST:
-            lcmd = (struct listcmd*) cmd;
+void guardar_linea_leida(char* linea)
+{
+    g_linea_leida = linea;
+    g_linea_lista = 1;
+    rl_callback_handler_remove();
+}
 
-            free_cmd(lcmd->left);
-            free_cmd(lcmd->right);
+char* leer_linea_readline()
+{
+    int fd_entrada = fileno(rl_instream ? rl_instream : stdin);
+    fd_set listos;
+
+    g_linea_lista = 0;
+    rl_callback_handler_install(g_prompt, guardar_linea_leida);
+    while (!g_linea_lista) {
+        FD_ZERO(&listos);
+        FD_SET(fd_entrada, &listos);
+        FD_SET(g_sigchld_fd, &listos);
+        if (select((fd_entrada > g_sigchld_fd ? fd_entrada : g_sigchld_fd) + 1,
+                   &listos, NULL, NULL, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            exit(EXIT_FAILURE);
+        }
+        if (FD_ISSET(g_sigchld_fd, &listos))
+            cosechar_pendientes();
+        if (FD_ISSET(fd_entrada, &listos))
+            rl_callback_read_char();
+    }
 
-            free(lcmd->right);
-            free(lcmd->left);
-            break;
+    return g_linea_leida;
+}
 
-        case PIPE:
-            pcmd = (struct pipecmd*) cmd;
+char* get_cmd()
+{
+    char* buf;
+    struct timespec ini, fin;
+    int reconstruido = !g_prompt_valido;
 
-            free_cmd(pcmd->left);
-            free_cmd(pcmd->right);
+    clock_gettime(CLOCK_MONOTONIC, &ini);
+    if (!g_prompt_valido)
+        actualizar_prompt();
+    clock_gettime(CLOCK_MONOTONIC, &fin);
 
-            free(pcmd->right);
-            free(pcmd->left);
-            break;
+    DPRINTF(DBG_TRACE, "prompt %s en %.1f us\n", reconstruido ? "reconstruido" : "en caché",
+            (fin.tv_sec - ini.tv_sec) * 1e6 + (fin.tv_nsec - ini.tv_nsec) / 1e3);
 
-        case BACK:
-            bcmd = (struct backcmd*) cmd;
+    // Lee la orden tecleada por el usuario
+    buf = leer_linea_readline();
 
-            free_cmd(bcmd->cmd);
+    // Si el usuario ha escrito una orden, almacenarla en la historia.
+    if(buf)
+        add_history(buf);
 
-            free(bcmd->cmd);
-            break;
+    return buf;
+}
 
-        case SUBS:
-            scmd = (struct subscmd*) cmd;
 
-            free_cmd(scmd->cmd);
+// Entrada no interactiva: fichero de órdenes, `-c` o una entrada estándar que
+// no es un terminal. Se lee línea a línea con getline(), sin prompt ni
+// historial. Es NULL si la entrada es interactiva y se usa `get_cmd`.
+FILE* g_entrada = NULL;
 
-            free(scmd->cmd);
-            break;
+// Si la entrada es stdin y admite lseek(), tras leer cada línea se devuelve
+// lo que quede en el búfer para que los comandos que lean de stdin vean el
+// resto de la entrada
+int g_entrada_sincronizar = 0;
 
-        case INV:
-        default:
-            panic("%s: estructura `cmd` desconocida\n", __func__);
+// `leer_orden` devuelve la siguiente línea de `g_entrada` (sin el '\n'
+// final) o NULL al llegar al final. La línea está en un búfer propio que se
+// reutiliza en la siguiente llamada, por lo que no hay que liberarla.
+
+char* leer_orden()
+{
+    static char* linea = NULL;
+    static size_t tam = 0;
+    ssize_t n;
+
+    if ((n = getline(&linea, &tam, g_entrada)) == -1) {
+        if (ferror(g_entrada)) {
+            perror("getline");
+            exit(EXIT_FAILURE);
+        }
+        return NULL;
     }
+    if (n > 0 && linea[n - 1] == '\n')
+        linea[n - 1] = '\0';
+
+    if (g_entrada_sincronizar && fflush(g_entrada) == EOF) {
+        perror("fflush");
+        exit(EXIT_FAILURE);
+    }
+
+    return linea;
 }
 
 
 /******************************************************************************
- * Lectura de la línea de órdenes con la biblioteca libreadline
+ * Caché de planes de ejecución
  ******************************************************************************/
 
 
-// `get_cmd` muestra un *prompt* y lee lo que el usuario escribe usando la
-// biblioteca readline. Ésta permite mantener el historial, utilizar las flechas
-// para acceder a las órdenes previas del historial, búsquedas de órdenes, etc.
+// Las líneas de órdenes que se repiten (scripts, bucles) no se vuelven a
+// analizar: el árbol `cmd` de cada línea analizada sin errores se guarda en
+// una caché LRU de tamaño fijo, indexada por el texto de la línea. Cada plan
+// tiene su propia arena y su propia copia de la línea, sobre la que apuntan
+// los argumentos del árbol. Los árboles no se modifican al ejecutarlos, y las
+// rutas de los comandos se siguen resolviendo con la tabla de `hash`, que ya
+// se invalida cuando cambia $PATH.
 
-char* get_cmd()
+#define TAM_CACHE_PLANES 32
+
+struct plan {
+    char* linea;            // Clave: la línea tal y como se leyó
+    unsigned hash;
+    char* texto;            // Copia de la línea tras el análisis léxico
+    struct cmd* cmd;
+    struct arena arena;
+    unsigned long uso;      // Momento del último uso (para LRU)
+    double segundos;        // Lo que costó analizarla
+};
+
+struct plan g_planes[TAM_CACHE_PLANES];
+unsigned long g_planes_uso = 0;
+unsigned long g_planes_aciertos = 0;
+unsigned long g_planes_fallos = 0;
+double g_planes_ahorrado = 0;
+
+double segundos_desde(struct timespec* ini)
 {
-    char* buf;
+    struct timespec fin;
 
-    uid_t uid = getuid();
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    return (fin.tv_sec - ini->tv_sec) + (fin.tv_nsec - ini->tv_nsec) / 1e9;
+}
 
-    struct passwd* passwd = getpwuid(uid);
-    if (!passwd) {
-        perror("getpwuid");
-        exit(EXIT_FAILURE);
-    }
-    char* user = passwd->pw_name;
-    char path[PATH_MAX];
-    if(!getcwd(path, PATH_MAX)){
-        perror("getcwd");
+char* strdup_o_panic(const char* s)
+{
+    char* copia;
+
+    if ((copia = strdup(s)) == NULL) {
+        perror("strdup");
         exit(EXIT_FAILURE);
     }
+    return copia;
+}
 
-    char* dir = basename(path);
-
-    // Calculamos cuantos espacios extra necesitamos para el 'prompt'
-    char caracteres_extra[] = {'@', '>', ' ', '\0'};
+// Devuelve el árbol `cmd` de 'linea', de la caché si ya se había analizado.
+// Si la línea tiene errores sintácticos el árbol ocupa una entrada de la caché
+// hasta que se ejecuta, pero no se puede encontrar y es la primera en
+// reemplazarse.
+struct cmd* obtener_plan(char* linea)
+{
+    struct plan* plan = NULL;
+    struct timespec ini;
+    unsigned h = hash_cadena(linea);
+    unsigned long errores = g_errores;
+    char* texto;
+    struct cmd* cmd;
+    int i;
 
-    // Usamos 'sizeof' para que tambien se contabilice el '\0'
-    char prompt[strlen(user) + strlen(dir) + sizeof(caracteres_extra)];
+    for (i = 0; i < TAM_CACHE_PLANES; i++)
+        if (g_planes[i].linea != NULL && g_planes[i].hash == h && strcmp(g_planes[i].linea, linea) == 0) {
+            plan = &g_planes[i];
+            plan->uso = ++g_planes_uso;
+            g_planes_aciertos++;
+            g_planes_ahorrado += plan->segundos;
+            DPRINTF(DBG_TRACE, "plan: acierto (%lu de %lu, %.1f us ahorrados)\n",
+                    g_planes_aciertos, g_planes_aciertos + g_planes_fallos, g_planes_ahorrado * 1e6);
+            return plan->cmd;
+        }
 
-    sprintf(prompt, "%s@%s> ", user, dir);
+    g_planes_fallos++;
+
+    // Entrada libre o, si no la hay, la usada hace más tiempo
+    for (i = 0; i < TAM_CACHE_PLANES; i++)
+        if (plan == NULL || g_planes[i].uso < plan->uso)
+            plan = &g_planes[i];
+
+    clock_gettime(CLOCK_MONOTONIC, &ini);
+    arena_reiniciar(&plan->arena);
+    g_arena = &plan->arena;
+    texto = strdup_o_panic(linea);
+    cmd = parse_cmd(texto);
+    g_arena = NULL;
+
+    free(plan->texto);
+    free(plan->linea);
+    plan->texto = texto;
+    plan->cmd = cmd;
+
+    if (g_errores != errores) {
+        plan->linea = NULL;
+        plan->uso = 0;
+        DPRINTF(DBG_TRACE, "plan: error sintáctico, no se guarda\n");
+        return cmd;
+    }
 
-    // Lee la orden tecleada por el usuario
-    buf = readline(prompt);
+    plan->linea = strdup_o_panic(linea);
+    plan->hash = h;
+    plan->uso = ++g_planes_uso;
+    plan->segundos = segundos_desde(&ini);
 
-    // Si el usuario ha escrito una orden, almacenarla en la historia.
-    if(buf)
-        add_history(buf);
+    DPRINTF(DBG_TRACE, "plan: fallo (%lu de %lu aciertos), analizada en %.1f us\n",
+            g_planes_aciertos, g_planes_aciertos + g_planes_fallos, plan->segundos * 1e6);
+    return cmd;
+}
 
-    return buf;
+void liberar_planes()
+{
+    for (int i = 0; i < TAM_CACHE_PLANES; i++) {
+        free(g_planes[i].linea);
+        free(g_planes[i].texto);
+        arena_liberar(&g_planes[i].arena);
+        g_planes[i].linea = g_planes[i].texto = NULL;
+    }
 }
 
 
@@ -1708,10 +4582,12 @@ char* get_cmd()
 
 void help(char **argv)
 {
-    info("Usage: %s [-d N] [-h]\n\
+    info("Usage: %s [-d N] [-c CMDLINE | FILE] [-h]\n\
          shell simplesh v%s\n\
          Options: \n\
          -d set debug level to N\n\
+         -c run CMDLINE and exit\n\
+         FILE run the command lines in FILE and exit\n\
          -h help\n\n",
          argv[0], VERSION);
 }
@@ -1720,13 +4596,17 @@ void help(char **argv)
 void parse_args(int argc, char** argv)
 {
     int option;
+    char* orden = NULL;
 
     // Bucle de procesamiento de parámetros
-    while((option = getopt(argc, argv, "d:h")) != -1) {
+    while((option = getopt(argc, argv, "d:c:h")) != -1) {
         switch(option) {
             case 'd':
                 g_dbg_level = atoi(optarg);
                 break;
+            case 'c':
+                orden = optarg;
+                break;
             case 'h':
             default:
                 help(argv);
@@ -1734,6 +4614,33 @@ void parse_args(int argc, char** argv)
                 break;
         }
     }
+
+    // Origen de las órdenes: -c, un fichero, stdin redirigido o el terminal
+    if (orden != NULL) {
+        if (*orden == '\0')
+            exit(EXIT_SUCCESS);
+        if ((g_entrada = fmemopen(orden, strlen(orden), "r")) == NULL) {
+            perror("fmemopen");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (optind < argc) {
+        if ((g_entrada = fopen(argv[optind], "re")) == NULL) {
+            perror(argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (!isatty(STDIN_FILENO)) {
+        g_entrada = stdin;
+        g_entrada_sincronizar = (lseek(STDIN_FILENO, 0, SEEK_CUR) != -1);
+    }
+
+    // Sin readline nadie vacía stdout en cada línea: con búfer por líneas la
+    // salida de los comandos internos no se desordena ni se duplica en los hijos
+    if (g_entrada != NULL && setvbuf(stdout, NULL, _IOLBF, 0) != 0) {
+        perror("setvbuf");
+        exit(EXIT_FAILURE);
+    }
 }
 
 int main(int argc, char** argv)
@@ -1768,17 +4675,15 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
-    // Cosecha de procesos zombies con manejador de SIGCHLD
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(struct sigaction));
-    sa.sa_handler = &handle_sigchld;
-    if(sigemptyset(&sa.sa_mask)){
-        perror("sigemptyset");
-        exit(EXIT_FAILURE);
-    }
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa, 0) == -1) {
-        perror("sigaction (SIGCHLD)");
+    // Cosecha de procesos zombies a través de un signalfd
+    iniciar_sigchld();
+
+    // Trabajos en segundo plano: un hueco por CPU y, al salir, los que aún
+    // esperan hueco se siguen poniendo en marcha según quedan huecos
+    if ((g_huecos = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        g_huecos = 1;
+    if (atexit(vaciar_cola) != 0) {
+        perror("atexit");
         exit(EXIT_FAILURE);
     }
 
@@ -1794,14 +4699,14 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
-    // Bucle de lectura y ejecución de órdenes
-    while ((buf = get_cmd()) != NULL)
+    // Bucle de lectura y ejecución de órdenes. Antes de cada orden se
+    // notifican los procesos en segundo plano que hayan terminado.
+    while (cosechar_pendientes(),
+           (buf = (g_entrada != NULL) ? leer_orden() : get_cmd()) != NULL)
     {
-        // Realiza el análisis sintáctico de la línea de órdenes
-        cmd = parse_cmd(buf);
-
-        // Termina en `NULL` todas las cadenas de las estructuras `cmd`
-        null_terminate(cmd);
+        // Realiza el análisis sintáctico de la línea de órdenes (o la toma
+        // de la caché de planes)
+        cmd = obtener_plan(buf);
 
         DBLOCK(DBG_CMD, {
             info("%s:%d:%s: print_cmd: ",
@@ -1811,16 +4716,16 @@ int main(int argc, char** argv)
         // Ejecuta la línea de órdenes
         run_cmd(cmd);
 
-        // Libera la memoria de las estructuras 'cmd'
-        free_cmd(cmd);
-
-        // Libera al propio 'cmd' (BOLETIN 1: EJERCICIO 3)
-        free(cmd);
-
-        // Libera la memoria de la línea de órdenes
-        free(buf);
+        // Libera la memoria de la línea de órdenes (la de `leer_orden` se
+        // reutiliza)
+        if (g_entrada == NULL)
+            free(buf);
     }
 
+    DPRINTF(DBG_TRACE, "plan: %lu aciertos de %lu líneas, %.1f us ahorrados\n",
+            g_planes_aciertos, g_planes_aciertos + g_planes_fallos, g_planes_ahorrado * 1e6);
+    liberar_planes();
+
     DPRINTF(DBG_TRACE, "END\n");
 
     return 0;